@@ -13,8 +13,6 @@
 
 #include "conbits.h"
 #include "stdint.h"
-#include "string.h"
-#include "stdio.h"
 #include "uart.h"
 
 // Useful defines
@@ -33,28 +31,291 @@
 #define CMD_READ '1'               // Read from the EPROM
 #define CMD_WRTE '2'               // Program the EPROM
 #define CMD_CHEK '3'               // Check EPROM is blank (all FF))
+#define CMD_PMAP 'P'               // Blank check, reply with non-blank pages
 #define CMD_IDEN '4'               // Get the ID of the device ("2716")
 #define CMD_TYPE '5'               // Set the device type
+#define CMD_MODE '6'               // Set the transfer mode (2 hex digits)
+#define CMD_WRNG 'W'               // Program a range (4 hex start, 4 hex len)
+#define CMD_PACK 'Z'               // Read a range run length packed (ditto)
+#define CMD_CRC  'C'               // CRC16 of a range (4 hex start, 4 hex len)
+#define CMD_VRFY 'V'               // Verify pages against CRCs, send those that differ
+#define CMD_BLCK 'K'               // Program a range in ACKed blocks (ditto)
+#define CMD_WIND 'X'               // Program a range in windowed CRC blocks (ditto)
+#define CMD_HEX  'H'               // Program Intel HEX records, to the EOF
+#define CMD_STAT 'S'               // Reply with the stats, '1' to clear them
+#define CMD_TRCE 'T'               // Reply with the trace, '1' to clear it
+#define CMD_BAUD 'B'               // Change baud rate (1 hex digit index)
+#define CMD_GANG 'G'               // Select the socket the reads use (1 digit)
 #define CMD_RSET '9'               // Reset the PIC
 #define CMD_INIT 'U'               // init the baud rate
 
-// Received chars are put into a queue.
-// See e.g. Aho, Hopcroft & Ullman, 'Data structures and Algorithms'
-#define QUEUESIZE 1024             // Queue size
-#define ENDQUEUE  QUEUESIZE-1      // End of queue
-#define HIWATER   QUEUESIZE-32     // The highwater mark, stop sending.
+// Received chars are put into a single producer (the isr), single
+// consumer (pop) ring. The isr only moves tail and pop only moves head,
+// and both are 8 bit so each update is atomic on the PIC16. Hence no
+// interrupt masking is needed. QUEUESIZE must be a power of 2, and 256
+// so the 8 bit indices wrap by themselves. One slot is kept free so a
+// full queue can be told from an empty one.
+#define QUEUESIZE 256              // Queue size
+#define QUEUEMASK (QUEUESIZE-1)    // Index mask
+#define HIWATER   (QUEUESIZE-32)   // The highwater mark, stop sending.
 #define LOWATER   32               // The lowwater mark, resume sending.
 
+// Transfer modes, sent as 2 hex digits after CMD_MODE.
+// In binary mode the data of CMD_READ and CMD_WRTE is sent as frames of
+// raw bytes: <len> <data 0..len-1> <sum>, where sum makes the 8 bit total
+// of len, data and sum zero (as in Intel HEX). A frame with len 0 ends
+// the transfer. Command chars and arguments are always ASCII.
+#define MODE_BINARY 0x01           // Binary framed data transfers
+#define MODE_FAST   0x02           // Fast (adaptive) programming pulses
+#define MODE_SKIPFF 0x04           // Don't pulse 0xFF, it's already erased
+#define MODE_VERIFY 0x08           // Read back each byte as it is programmed
+#define MODE_TAGGED 0x10           // Reply in "{c" and "}\n", c is the cmd
+#define MODE_ALL    0x1f           // All the modes we support
+#define READFRAME   64             // Data bytes per frame sent by read
+#define READROW     16             // Data bytes per line sent by read
+#define ROWSIZE     (6+READROW*3+1)// "aaaa: " + "dd " per byte + null
+#define BUFSIZE     1024           // Whole device buffer, for the 2708
+#define BLOCKSIZE   256            // CMD_BLCK block, 2 fit in buffer
+#define BLOCK_ACK   '+'            // Reply when a block is received
+#define BLOCK_NAK   '-'            // CMD_WIND reply, block to send again
+#define WINDSIZE    64             // Most data bytes in a CMD_WIND block
+#define WINDBLOCKS  3              // CMD_WIND blocks the host may have
+                                   // unACKed, they must fit the queue
+#define WINDTRIES   8              // NAKs in a row before we give up
+#define PAGESIZE    256            // CMD_VRFY page, as in the CMD_PMAP map
+#define VERIFY_MAX  16             // Verify errors listed, then we stop
+#define PACK_LIT    128            // Most bytes in a CMD_PACK literal run
+#define PACK_REP    129            // Most bytes in a CMD_PACK repeat run
+
+// Intel HEX record types, for CMD_HEX
+#define HEX_DATA 0x00              // data
+#define HEX_EOF  0x01              // end of file
+#define HEX_ESEG 0x02              // extended segment address, must be 0
+#define HEX_SSEG 0x03              // start segment address, ignored
+#define HEX_ELIN 0x04              // extended linear address, must be 0
+#define HEX_SLIN 0x05              // start linear address, ignored
+
+// Program pulses are timed by Timer1 and CCP1. At 20MHz, Fosc/4 with a
+// 1:8 prescale is 1.6uS a count, so the longest pulse is 104mS.
+#define TMR1_PER_MS 625u
+#define CCP_LO_HI   0x08           // Compare, pin low now, high on match
+#define CCP_HI_LO   0x09           // Compare, pin high now, low on match
+
+// Timer0 gives a 1mS tick. At 20MHz, Fosc/4 with a 1:32 prescale is 
+// 6.4uS a count, so we reload to overflow after 156 counts.
+#define TMR0_RELOAD (256-156)
+
+// What the LEDs show, driven from the tick by led_tick().
+#define LED_IDLE    0              // green on, ready for a cmd
+#define LED_BUSY    1              // orange on, in a cmd
+#define LED_WAIT    2              // orange on, green flashing, waiting for data
+#define LED_INIT    3              // orange flashing, waiting for 'U'
+
+// The last good config, kept in data EEPROM so after a reset we can start
+// at the host's rate without waiting for the 'U'.
+#define EE_MAGIC    0              // EE_VALID if the rest is good
+#define EE_BRGH     1              // SPBRGH
+#define EE_BRGL     2              // SPBRGL
+#define EE_TYPE     3              // devType
+#define EE_SUM      4              // makes the sum of the record 0
+#define EE_SIZE     5
+#define EE_VALID    0xa5
+#define QUIET_MS    20             // line quiet this long before auto baud,
+                                   // or after a failed cmd
+
+// What the isr wants main to do about the link
+#define LINK_NONE   0
+#define LINK_REPLY  1              // 'U' between cmds, reply with the rate
+#define LINK_AUTO   2              // host isn't at our rate, auto baud
+
 //
 // static variables
 //
-static char    queue[QUEUESIZE];   // The receiver queue
-static int16_t head = 0;           // head of the queue
-static int16_t tail = ENDQUEUE;    // tail of the  queue
-static bool    cmd_active = false; // Are we in a cmd?
-static bool    queue_empty = false;// wait if queue empty
-static int8_t  devType = 0;        // 0 = 2716, 1 = 2732, 2 = 2532
-static int16_t bytes = 0;          // size of program data
+static volatile char    queue[QUEUESIZE]; // The receiver queue
+static volatile uint8_t head = 0;  // next char to pop, moved by pop()
+static volatile uint8_t tail = 0;  // next free slot, moved by push()
+static volatile bool cmd_active = false; // Are we in a cmd?
+static volatile bool aborted = false;    // BREAK seen, until the line is quiet
+static volatile bool     overflow = false; // queue was full, orange on
+static volatile uint16_t ticks = 0;        // mS since reset
+static volatile uint8_t  ledMode = LED_INIT;
+static volatile uint8_t  linkReq = LINK_NONE;
+static volatile bool linkStored = false; // at the stored rate, host not heard yet
+static int8_t  devType = 0;        // DEV_2716 etc, index into devices[]
+static int16_t bytes = 2048;       // size of program data
+static uint8_t mode = 0;           // Transfer mode bits, see MODE_BINARY
+static uint8_t frame[READFRAME];   // Binary frame, or line, to send
+static uint8_t buffer[BUFSIZE];    // Data received to program
+static uint16_t verifyAddr[VERIFY_MAX]; // MODE_VERIFY errors, where
+static uint8_t  verifyData[VERIFY_MAX]; // and what read back
+static uint8_t  verifyErrs = 0;
+static const char hexDigits[] = "0123456789abcdef";
+
+// Counters for CMD_STAT, to tune the link and tell link problems from
+// chip problems. Chars sent are counted by uart.c.
+typedef struct {
+    uint32_t received;             // chars received
+    uint16_t ctsStops;             // times the queue reached HIWATER
+    uint16_t dropped;              // chars dropped as the queue was full
+    uint16_t ferr;                 // framing errors
+    uint16_t oerr;                 // overrun errors
+    uint32_t starvedMs;            // mS pop() waited for a char
+    uint32_t pulseMs;              // mS of program pulses
+    uint16_t naks;                 // CMD_WIND blocks asked for again
+} stats_t;
+static volatile stats_t stats;
+
+// A ring of the last TRACESIZE events for CMD_TRCE, so the host can see
+// the timeline of a cmd. The time is the mS tick and the Timer0 count in
+// it, 6.4uS a count. 
+#define TRACESIZE  32              // Must be a power of 2
+#define TRACEMASK  (TRACESIZE-1)
+#define TRACE_WAIT 2               // Shortest pop() wait traced, mS
+
+#define TR_CMD     1               // cmd started, arg is the cmd char
+#define TR_FIRST   2               // first char popped by the cmd
+#define TR_WAIT    3               // pop() waited, arg is mS
+#define TR_HIGH    4               // queue reached HIWATER, CTS_ high
+#define TR_LOW     5               // queue drained to LOWATER, CTS_ low
+#define TR_BLOCK   6               // data programmed, arg is next address
+#define TR_DONE    7               // cmd finished, arg is the cmd char
+#define TR_NAK     8               // CMD_WIND block NAKed, arg is its number
+#define TR_ABORT   9               // BREAK from the host, arg is the cmd char
+
+typedef struct {
+    uint16_t ms;
+    uint8_t  sub;                  // Timer0 counts into the mS
+    uint8_t  code;                 // TR_CMD etc
+    uint16_t arg;
+} trace_t;
+static trace_t trace[TRACESIZE];
+static uint8_t traceNext  = 0;     // slot for the next event
+static uint8_t traceCount = 0;     // events in the ring, up to TRACESIZE
+static bool    traceFirst = false; // trace the next pop()
+
+// Device timing. Short waits are in loops of wait_loops(), at least 
+// 3 instruction cycles (600nS at 20MHz) each, rounded up by NS().
+#define LOOP_NS (3 * 4000000000UL / _XTAL_FREQ)
+#define NS(t)   (((t) + LOOP_NS - 1) / LOOP_NS)
+
+// Control pins on port C, set together by set_pins().
+#define PIN_CS   0x01              // RC0, CS_ for 2716, G_/VPP for 2732
+#define PIN_WE   0x02              // RC1, WE_, low puts VPP on
+#define PIN_PGM  0x04              // RC2, PGM for 2716, E_ or PGM_ others
+#define PIN_MASK 0x07
+
+// Relays on port E, set by do_type().
+#define RLY_A    0x01              // RE0, RLA for 2732
+#define RLY_B    0x02              // RE1, RLB for 2532
+#define RLY_MASK 0x03
+
+// Gang programming, for duplicating an image. Build with GANG_SOCKETS=2
+// for a board where the sockets share the address, data and VPP lines,
+// and each socket's control lines are gated by its own line, high to
+// enable: socket 0 on RE2, socket 1 on RC5 (the red LED on a single
+// socket board). Each byte is pulsed into all the live sockets at once,
+// and checked and read back from each alone. A socket that fails is
+// dropped, and the others carry on.
+#ifndef GANG_SOCKETS
+#define GANG_SOCKETS 1
+#endif
+#if GANG_SOCKETS < 1 || GANG_SOCKETS > 2
+#error "GANG_SOCKETS must be 1 or 2, there are no more spare pins"
+#endif
+#define GANG_ALL ((1 << GANG_SOCKETS) - 1)
+
+static uint8_t gangLive = GANG_ALL;// sockets still being programmed
+static uint8_t gangFail = 0;       // sockets dropped from this write
+static uint8_t gangRead = 0;       // socket the read cmds use
+#if GANG_SOCKETS > 1
+static uint8_t verifySock[VERIFY_MAX]; // socket of each MODE_VERIFY error
+#endif
+
+// Everything that differs between devices. The program pulse is always
+// PIN_PGM toggled from progPins. A device with size 0 isn't supported.
+typedef struct {
+    char     name[5];              // Reply to CMD_IDEN
+    uint16_t size;                 // bytes, at most BUFSIZE if passes > 1
+    uint8_t  readPins;             // control pins to read
+    uint8_t  idlePins;             // control pins with outputs disabled
+    uint8_t  progPins;             // control pins with VPP on, between pulses
+    uint8_t  verifyPins;           // control pins to read back while programming
+    uint8_t  relays;               // port E relays
+    uint8_t  tAS;                  // address setup before program pulse
+    uint8_t  tACC;                 // address and CE_ to data valid
+    uint8_t  tOE;                  // port D turn round and OE_ to data
+    uint8_t  pulseMs;              // classic program pulse, mS
+    uint8_t  fastMax;              // max 1mS fast pulses, 0 = classic only
+    uint8_t  passes;               // passes over the whole range
+} device_t;
+
+static const device_t devices[] = {
+    // DEV_2716. Verify with VPP on and CS_ low.
+    { "2716", 2048, 
+      PIN_WE, PIN_WE|PIN_CS, PIN_CS, 0, 
+      0,
+      NS(2000), NS(450), NS(120), 50, 25, 1 },
+    // DEV_2732. VPP is on G_, so it must be off to verify. Classic only,
+    // fast pulses and the overprogram could take 4 times the 10mS pulse.
+    { "2732", 4096, 
+      PIN_WE, PIN_WE|PIN_CS|PIN_PGM, PIN_CS|PIN_PGM, PIN_WE, 
+      RLY_A,
+      NS(2000), NS(450), NS(150), 10, 0, 1 },
+    // DEV_2532. CS_ not used. PD/PGM_ low with VPP on is the program 
+    // pulse, so VPP must be off to verify.
+    { "2532", 4096, 
+      PIN_WE, PIN_WE|PIN_PGM, PIN_PGM, PIN_WE, 
+      RLY_B,
+      NS(2000), NS(450), NS(150), 50, 25, 1 },
+    // DEV_2708, on the 2708 adaptor, driven as 2708prg.X does it. Read
+    // with RC0 high and RC1 low. Program with RC0 and RC1 low, RC2 idling
+    // high and pulsed low for 1mS. That made one pass per write cmd, here
+    // it is 100 passes over the whole range.
+    { "2708", 1024, 
+      PIN_CS|PIN_PGM, PIN_CS|PIN_WE|PIN_PGM, PIN_PGM, PIN_CS|PIN_PGM, 
+      0,
+      NS(10000), NS(450), NS(120), 1, 0, 100 },
+    // DEV_T2716, not supported.
+    { "", 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 },
+    // DEV_8755, not supported. 8755prg.X puts the low address on port D
+    // and the high address on RC0-2, strobed by ALE on RB0, with CE, RD_,
+    // PROG and the program enable on RB1-4. None of that fits this table.
+    { "", 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 }
+};
+#define NDEVS (sizeof(devices) / sizeof(devices[0]))
+static const device_t *dev = &devices[DEV_2716]; // Selected by do_type()
+
+// A block being received a char at a time by rx_feed(), so we can take
+// chars from the queue during program pulses. In ascii mode a block is
+// 2 hex digits per byte, in binary mode one or more frames.
+#define RX_HI   0                  // ascii, waiting for the high digit
+#define RX_LO   1                  // ascii, waiting for the low digit
+#define RX_LEN  2                  // binary, waiting for a frame length
+#define RX_DATA 3                  // binary, in frame data
+#define RX_SUM  4                  // binary, waiting for the checksum
+
+#define RX_MORE 0                  // rx_feed() wants more chars
+#define RX_DONE 1                  // block complete
+#define RX_BAD  2                  // bad frame, or frame too big
+#define RX_IDLE 3                  // no block being received
+
+typedef struct {
+    uint8_t *buf;                  // where the block goes
+    uint16_t need;                 // bytes in the block
+    uint16_t got;                  // so far
+    uint8_t  state;                // RX_HI etc
+    uint8_t  left;                 // bytes left in this frame
+    uint8_t  sum;                  // frame checksum so far
+    uint8_t  status;               // RX_MORE etc
+    bool     ack;                  // send BLOCK_ACK when done
+} rxblock_t;
+static rxblock_t *rxPending = 0;   // block to feed during program pulses
+
+// CRC16 CCITT (polynomial 0x1021), processed a nibble at a time.
+static const uint16_t crcTable[16] = {
+    0x0000, 0x1021, 0x2042, 0x3063, 0x4084, 0x50a5, 0x60c6, 0x70e7,
+    0x8108, 0x9129, 0xa14a, 0xb16b, 0xc18c, 0xd1ad, 0xe1ce, 0xf1ef
+};
 
 // ****************************************************************************
 // setCTS()
@@ -62,122 +323,160 @@ static int16_t bytes = 0;          // size of program data
 //
 void setCTS(bool b)
 {
-    PORTAbits.RA4 = b;
+    LATAbits.LATA4 = b;
 }
 
 // ****************************************************************************
-// reset the queue
+// Add an event to the trace. Called by the isr and main, so block the
+// isr, but leave GIE as it was.
 //
-void clear()
+void trace_event(uint8_t code, uint16_t arg)
 {
-    memset(queue, 0x00, QUEUESIZE);
-    head = 0;
-    tail = ENDQUEUE; 
-    cmd_active   = false;
+    bool     gie = INTCONbits.GIE;
+    trace_t *t;
+    
+    INTCONbits.GIE = 0;
+    t       = &trace[traceNext];
+    t->ms   = ticks;
+    t->sub  = TMR0 - TMR0_RELOAD;
+    t->code = code;
+    t->arg  = arg;
+    traceNext = (traceNext + 1) & TRACEMASK;
+    if (traceCount < TRACESIZE) {
+        traceCount++;
+    }
+    INTCONbits.GIE = gie;
 }
 
 // ****************************************************************************
-// Get the next position clockwise in array, handling begin/end of array.
+// reset the queue. Only the consumer side moves, so the isr can keep
+// pushing while we do this.
 //
-int16_t addone(int16_t i)
+void clear()
 {
-    if (i == ENDQUEUE)
-        return 0;
-    return i+1;
+    head = tail;
+    cmd_active = false;
+    overflow = false;
+    setCTS(false);
 }
 
 // ****************************************************************************
-// How many items are in the queue? Set CTS if more than hiwater mark.
+// How many items are in the queue?
 //
-int16_t size()
+uint8_t size()
 {
-    int16_t s = addone(tail) - head;
-    if (s > HIWATER) {
-        setCTS(true);
-    }
-    if (s < LOWATER) {
-        setCTS(false);
-    }
-    return s;
+    return (uint8_t) (tail - head) & QUEUEMASK;
 }
 
 // ****************************************************************************
 // Is the queue empty?
-// An empty queue has head one more (clockwise) than tail.
 //
 bool empty()
 {
-    if (addone(tail) == head)
-        return true;
-    return false;
+    return head == tail;
 }
+
 // ****************************************************************************
 // push a char onto queue. Called by interrupt.
-// to enqueue (push), we move tail one position clockwise.
-// e.g. head=0, tail = ENDQUEUE. after push, 
-//   queue[0]=c
-//   head = 0;
-//   tail = 0;
+// Set CTS when we pass the highwater mark, pop() clears it again when
+// the queue has drained below the lowwater mark.
 //
 void push(char c)
 {    
-    // If the queue is nearly full, set CTS.)
-    int16_t s = addone(tail) - head;
-    if (s > HIWATER) {
-        setCTS(true);
-    }
-    else {
-        setCTS(false);
+    uint8_t s = size();
+    
+    if (s == QUEUEMASK) {
+        // error - queue is full, drop the char. Orange led on.
+        overflow = true;
+        stats.dropped++;
+        return;
     }
-        
-    if ( addone(addone(tail)) == head ) {
-        // error - queue is full. Flash orange led.
-        PORTCbits.RC4 = 1;
-        __delay_ms(100);
-        PORTCbits.RC4 = 0;
-        __delay_ms(100);
+    
+    queue[tail] = c;
+    tail = (tail + 1) & QUEUEMASK;
+    
+    if (s >= HIWATER) {
+        if (!LATAbits.LATA4) {
+            stats.ctsStops++;
+            trace_event(TR_HIGH, s);
+        }
+        setCTS(true);
     }
-    else {
-        tail = addone(tail);
-        queue[tail] = c;
-    }  
+}
+
+// ****************************************************************************
+// Get the mS tick. It's 16 bits, so don't let the isr change it while we
+// read it.
+//
+uint16_t get_ticks()
+{
+    INTCONbits.GIE = 0;
+    uint16_t t = ticks;
+    INTCONbits.GIE = 1;
+    return t;
 }
 
 // ****************************************************************************
 // pop a char from queue. 
-// to dequeue, we move head one position clockwise.
-// e.g. after one push, head=0,tail=0
-// c = queue[0]
-// head = 1;
-// tail = 0; (note that now queue is empty as tail+1 == head))
 //
 char pop()
 {
-    // Check for empty. Do this before disabling interrupts
-    // as need to receive chars still.
-    while (empty()) {
-        // Wait for queue to fill, flash green led.
-        PORTCbits.RC3 = 1;
-        __delay_ms(100);
-        PORTCbits.RC3 = 0;
-        __delay_ms(100);
+ 
+    // Wait for queue to fill, flash green led. The isr pushes chars, so
+    // we take the first one as soon as it arrives.
+    if (empty()) {
+        uint16_t t = get_ticks();
+        ledMode = LED_WAIT;
+        while (empty() && !aborted) {
+            NOP();
+        }
+        ledMode = LED_BUSY;
+        t = get_ticks() - t;
+        stats.starvedMs += t;
+        if (t >= TRACE_WAIT) {
+            trace_event(TR_WAIT, t);
+        }
     }
-  
-    // Disable interrupts
-    INTCONbits.GIE = 0;
-    PIE1bits.RCIE=0;
     
+    // Still empty only if aborted, so nothing more is coming. The cmd
+    // will see cmd_active is false and stop, give it anything till then.
+    if (empty()) {
+        return 0;
+    }
+    if (traceFirst) {
+        traceFirst = false;
+        trace_event(TR_FIRST, 0);
+    }
+  
     // Get the head of the queue.
     char c = queue[head];
-    head = addone(head);
+    head = (head + 1) & QUEUEMASK;
     
-    // Enable interrupts
-    INTCONbits.GIE = 1;
-    PIE1bits.RCIE=1;
+    // Resume sending once we have drained.
+    if (LATAbits.LATA4 && size() < LOWATER) {
+        setCTS(false);
+        trace_event(TR_LOW, 0);
+    }
     
     return c;
 }
 
+// ****************************************************************************
+// pop a char, but only wait up to ms for it. Returns false if none came.
+//
+bool pop_timed(char *c, uint8_t ms)
+{
+    uint16_t t = get_ticks();
+    
+    while (empty()) {
+        if ((uint16_t) (get_ticks() - t) > ms) {
+            return false;
+        }
+    }
+    *c = pop();
+    return true;
+}
+
 // ****************************************************************************
 // first - get the first char pushed on the queue, without removing it.
 char first()
@@ -185,6 +484,24 @@ char first()
     return queue[head];
 }
 
+// ****************************************************************************
+// End a cmd, keeping what is queued after it, which may be the next cmd.
+// Anything before that cmd's '$', such as the CR LF after an Intel HEX
+// EOF record, is dropped. The isr only sees a cmd start as it pushes, so
+// check for one that is queued already. The isr still queues everything
+// while cmd_active is set, so keep it out until that is right.
+//
+void next_cmd()
+{
+    INTCONbits.GIE = 0;
+    while (!empty() && first() != '$') {
+        pop();
+    }
+    cmd_active = size() > 1;
+    overflow   = false;
+    INTCONbits.GIE = 1;
+}
+
 // ****************************************************************************
 // convert char to hex digit. Handle upper and lower case.
 //
@@ -198,6 +515,251 @@ uint8_t charToHexDigit(char c)
     return c - '0';
 }
 
+// ****************************************************************************
+// get two ascii hex chars from queue and convert to 8 bit data.
+//
+uint8_t get_hex8()
+{
+    uint8_t hi = charToHexDigit(pop());
+    uint8_t lo = charToHexDigit(pop());
+    return hi*16+lo;
+}
+
+// ****************************************************************************
+// get four ascii hex chars from queue and convert to 16 bit data.
+//
+uint16_t get_hex16()
+{
+    uint16_t hi = get_hex8();
+    return (hi << 8) | get_hex8();
+}
+
+// ****************************************************************************
+// Put 2 hex digits for d at p, return the position after them.
+//
+char *hex8(char *p, uint8_t d)
+{
+    *p++ = hexDigits[d >> 4];
+    *p++ = hexDigits[d & 0x0f];
+    return p;
+}
+
+// ****************************************************************************
+// Put 4 hex digits for d at p, return the position after them.
+//
+char *hex16(char *p, uint16_t d)
+{
+    p = hex8(p, d >> 8);
+    return hex8(p, d & 0xff);
+}
+
+// ****************************************************************************
+// Send d as 2 hex digits.
+//
+void put_hex8(uint8_t d)
+{
+    uart_putc(hexDigits[d >> 4]);
+    uart_putc(hexDigits[d & 0x0f]);
+}
+
+// ****************************************************************************
+// Send d as 4 hex digits.
+//
+void put_hex16(uint16_t d)
+{
+    put_hex8(d >> 8);
+    put_hex8(d & 0xff);
+}
+
+// ****************************************************************************
+// Send 8 hex digits for d
+//
+void put_hex32(uint32_t d)
+{
+    put_hex16(d >> 16);
+    put_hex16(d & 0xffff);
+}
+
+// ****************************************************************************
+// Send d in decimal.
+//
+void put_dec(uint16_t d)
+{
+    char s[6];
+    char *p = s + sizeof(s) - 1;
+    
+    *p = 0;
+    do {
+        *--p = '0' + d % 10;
+        d /= 10;
+    } while (d);
+    uart_puts(p);
+}
+
+// ****************************************************************************
+// Send a line of n data bytes as "aaaa: dd dd ... dd\n"
+//
+void put_row(uint16_t addr, const uint8_t *data, uint8_t n)
+{
+    char row[ROWSIZE];
+    char *p = hex16(row, addr);
+    uint8_t i;
+    
+    *p++ = ':';
+    for (i = 0; i < n; ++i) {
+        *p++ = ' ';
+        p = hex8(p, data[i]);
+    }
+    *p++ = '\n';
+    *p = 0;
+    uart_puts(row);
+}
+
+// ****************************************************************************
+// Add byte b to the running CRC16 crc. Start with crc = 0xffff.
+//
+uint16_t crc16(uint16_t crc, uint8_t b)
+{
+    crc = (crc << 4) ^ crcTable[(crc >> 12) ^ (b >> 4)];
+    crc = (crc << 4) ^ crcTable[(crc >> 12) ^ (b & 0x0f)];
+    return crc;
+}
+
+// ****************************************************************************
+// get a 4 hex digit start and length, and check they are in the device.
+// Returns false, with the reply sent, if not.
+//
+bool get_range(uint16_t *start, uint16_t *len)
+{
+    *start = get_hex16();
+    *len   = get_hex16();
+    
+    if (*start > bytes || *len > bytes - *start) {
+        uart_puts("bad range");
+        return false;
+    }
+    return true;
+}
+
+// ****************************************************************************
+// get a range as get_range(), for the cmds that program each block as it
+// comes. The 2708 needs every byte for each pass, so they can't do it.
+//
+bool get_block_range(uint16_t *start, uint16_t *len)
+{
+    if (!get_range(start, len)) {
+        return false;
+    }
+    if (dev->passes > 1) {
+        uart_puts("bad type");
+        return false;
+    }
+    return true;
+}
+
+// ****************************************************************************
+// Send a binary frame: length, data, checksum.
+//
+void send_frame(const uint8_t *buf, uint8_t len)
+{
+    uint8_t sum = len;
+    uint8_t i;
+    
+    uart_putc((char) len);
+    for (i = 0; i < len; ++i) {
+        uart_putc((char) buf[i]);
+        sum += buf[i];
+    }
+    uart_putc((char) (0 - sum));
+}
+
+// ****************************************************************************
+// Receive a binary frame of at most max bytes into buf. Returns false if
+// the checksum is bad, or the length is more than max, in which case only
+// the length has been read.
+//
+bool recv_frame(uint8_t *buf, uint8_t max, uint8_t *len)
+{
+    uint8_t n = (uint8_t) pop();
+    uint8_t sum = n;
+    uint8_t i;
+    
+    *len = n;
+    if (n > max) {
+        return false;
+    }
+    for (i = 0; i < n; ++i) {
+        buf[i] = (uint8_t) pop();
+        sum += buf[i];
+    }
+    sum += (uint8_t) pop();
+    
+    return sum == 0;
+}
+
+// ****************************************************************************
+// Reply to a frame that recv_frame() didn't accept.
+//
+void frame_error(uint8_t n, uint8_t max)
+{
+    uart_puts(n > max ? "too big" : "bad frame");
+}
+
+// ****************************************************************************
+// Most we can receive in one frame when there are n bytes left.
+//
+uint8_t frame_max(uint16_t n)
+{
+    return n > 255 ? 255 : (uint8_t) n;
+}
+
+// ****************************************************************************
+// Set the LEDs for ledMode. Called from the isr every mS.
+//
+void led_tick()
+{
+    bool slow = (ticks & 0x100) != 0; // flash at ~2Hz
+    bool fast = (ticks & 0x080) != 0; // flash at ~4Hz
+    
+    switch (ledMode) {
+        case LED_IDLE:
+            LATCbits.LATC3 = 1; // green on
+            LATCbits.LATC4 = overflow;
+            break;
+        case LED_BUSY:
+            LATCbits.LATC3 = 0; // green off
+            LATCbits.LATC4 = 1; // orange on
+            break;
+        case LED_WAIT:
+            LATCbits.LATC3 = fast;
+            LATCbits.LATC4 = 1; // orange on
+            break;
+        case LED_INIT:
+            LATCbits.LATC3 = 0; // green off
+            LATCbits.LATC4 = slow;
+            break;
+    }
+}
+
+// ****************************************************************************
+// Initialise timer0 for the 1mS tick, and timer1 for program pulses
+//
+void timer_init(void)
+{
+    OPTION_REGbits.TMR0CS = 0;   // Fosc/4
+    OPTION_REGbits.PSA    = 0;   // use the prescaler
+    OPTION_REGbits.PS     = 4;   // 1:32
+    TMR0 = TMR0_RELOAD;
+    INTCONbits.TMR0IF = 0;
+    INTCONbits.TMR0IE = 1;
+    
+    // Timer1 for program pulses, started by pulse_start()
+    T1CONbits.TMR1CS = 0;        // Fosc/4
+    T1CONbits.T1CKPS = 3;        // 1:8
+    T1CONbits.TMR1ON = 0;
+    CCP1CON = 0;
+}
+
 // ****************************************************************************
 // Initialise the ports
 //
@@ -243,7 +805,7 @@ void ports_init(void)
     PORTCbits.RC2 = 0; // set PGM false
     PORTCbits.RC3 = 0; // green off
     PORTCbits.RC4 = 0; // orange off
-    PORTCbits.RC5 = 0; // red off
+    PORTCbits.RC5 = 0; // red off, or socket 1 gated off if ganged
     
     // Port D is data D0-A7, either input or output.
     TRISD = INPUT;
@@ -252,383 +814,1933 @@ void ports_init(void)
     TRISE = 0;
     LATEbits.LATE0=0;
     LATEbits.LATE1=0;
-    LATEbits.LATE2=0;
+    LATEbits.LATE2=0;  // socket 0 gated off if ganged
 }
 
 // ****************************************************************************
-// Set the device type and the RE0/1 bits
+// Read a byte of data EEPROM
 //
-void
-do_type()
+uint8_t ee_read(uint8_t addr)
 {
-    devType = (int8_t) pop() - (int8_t) '0';
-            
-    if (devType == DEV_2716) {
-        bytes = 2048;    // 2716 has 2K EPROM
-        PORTEbits.RE0=0; //
-        PORTEbits.RE1=0; //
-    } else 
-	if (devType == DEV_2732) {
-        bytes = 4096;    // 2732 has 4K EPROM
-        PORTEbits.RE0=1; //
-        PORTEbits.RE1=0; //
-    } else 
-	if (devType == DEV_2532) {
-        bytes = 4096;    // 2532 has 4K EPROM
-        PORTEbits.RE0=0; //
-        PORTEbits.RE1=1; //
-    }
-	else {
-    	uart_puts("bad type");
-		return;
-	}
-    uart_puts("OK");
+    EEADRL = addr;
+    EECON1bits.CFGS  = 0;         // data EEPROM, not config
+    EECON1bits.EEPGD = 0;         // or flash
+    EECON1bits.RD    = 1;
+    return EEDATL;
 }
 
 // ****************************************************************************
-// high priority service routine for UART receive
+// Write a byte of data EEPROM, if it has changed. Takes ~4mS, the isr
+// carries on meanwhile, but must not get in the unlock sequence.
 //
-void __interrupt() isr(void)
+void ee_write(uint8_t addr, uint8_t data)
 {
-        char c = 0;
-
-        // Disable interrupts
-        INTCONbits.GIE = 0;
-        PIE1bits.RCIE=0;
-
-        // Get the character from uart
-        bool ok = uart_getc(&c);
-        if (ok) {
-            // Push the char onto stack
-            push(c);
-
-            // Check if we have a cmd yet. 
-            int16_t n = size();
-            if ( (first() == '$') && n > 1) {
-                // We have a command (2 chars at head of queue))
-                cmd_active = true;
-            }
-        }
-
-        // Enable interrupts
-        PIE1bits.RCIE=1;
-        INTCONbits.GIE = 1;
+    bool gie = INTCONbits.GIE;
+    
+    // ee_read() leaves EEADRL and EECON1 set up for the write
+    if (ee_read(addr) == data) {
+        return;
+    }
+    EEDATL = data;
+    EECON1bits.WREN = 1;
+    INTCONbits.GIE  = 0;
+    EECON2 = 0x55;
+    EECON2 = 0xaa;
+    EECON1bits.WR   = 1;
+    INTCONbits.GIE  = gie;
+    while (EECON1bits.WR) {
+        NOP();
+    }
+    EECON1bits.WREN = 0;
 }
 
 // ****************************************************************************
-// Set the address on ports A and B
+// Save the baud rate and device type, for the next reset.
 //
-void setup_address(uint16_t addr)
-{                
-    // Set the address lines. B0-7 is A0-7, A0-2 is A8-11
-    uint8_t hi = addr >> 8;
-    LATB       = addr & 0xff;
-    LATA       = hi   & 0x0f;
-        
-    // wait, Tcss
-    __delay_us(10);
+void config_save()
+{
+    uint16_t brg = uart_get_brg();
+    uint8_t  rec[EE_SIZE];
+    uint8_t  i;
+    
+    rec[EE_MAGIC] = EE_VALID;
+    rec[EE_BRGH]  = brg >> 8;
+    rec[EE_BRGL]  = brg & 0xff;
+    rec[EE_TYPE]  = (uint8_t) devType;
+    rec[EE_SUM]   = 0;
+    for (i = 0; i < EE_SUM; i++) {
+        rec[EE_SUM] -= rec[i];
+    }
+    for (i = 0; i < EE_SIZE; i++) {
+        ee_write(i, rec[i]);
+    }
 }
 
 // ****************************************************************************
-// Read a byte from port D
+// Get the saved baud rate and device type. False if there isn't a good
+// record, e.g. the EEPROM is erased, or we were reset while saving.
 //
-uint8_t read_port()
+bool config_load(uint16_t *brg, uint8_t *type)
 {
-    // Set port D to input to read from DUT
-    TRISD = INPUT;
-    __delay_us(1);
+    uint8_t sum = 0;
+    uint8_t i;
     
-    if (devType == DEV_2716) {
-        LATCbits.LATC0 = 0; // Set CS_ true
-        LATCbits.LATC2 = 0; // Set PD/PGM lo
-    } 
-    else if (devType == DEV_2732) {
-        LATCbits.LATC0 = 0; // Set G_/VPP lo
-        LATCbits.LATC2 = 0; // Set E_ true
+    for (i = 0; i < EE_SIZE; i++) {
+        sum += ee_read(i);
     }
-    else if (devType == DEV_2532) {
-        LATCbits.LATC2 = 0; // Set PD/PGM_ lo
+    if (sum != 0 || ee_read(EE_MAGIC) != EE_VALID) {
+        return false;
     }
+    *brg  = ((uint16_t) ee_read(EE_BRGH) << 8) | ee_read(EE_BRGL);
+    *type = ee_read(EE_TYPE);
+    return *brg != 0;
+}
 
-    __delay_us(1);
-
-    // Read port D
-    uint8_t data = PORTD;
-    
-    return data;
+// ****************************************************************************
+// Select device type t and set the RE0/1 bits. False if there's no such type.
+//
+bool set_type(uint8_t t)
+{
+    if (t >= NDEVS || devices[t].size == 0) {
+        return false;
+    }
+    devType = t;
+    dev     = &devices[t];
+    bytes   = dev->size;
+    LATE    = (LATE & ~RLY_MASK) | dev->relays;
+    return true;
 }
 
 // ****************************************************************************
-// Init uart baud rate
+// Set the device type, and save it for the next reset
 //
-void do_init()
+bool
+do_type()
 {
-    uint16_t rate;
-    char s[8];
-        
-    rate = uart_init_brg();
+    uint8_t t = (uint8_t) (pop() - '0');
+            
+    if (!set_type(t)) {
+    	uart_puts("bad type");
+		return false;
+	}
+    config_save();
     
-    sprintf(s, "%d\n", rate);
-    uart_puts(s);
+    uart_puts("OK");
+    return true;
 }
 
 // ****************************************************************************
-// check eprom is wiped clean
-// Timing critical code. At 20MHz xtal clock, each instruction = 200nS
+// Select the socket the read cmds use, so each ganged chip can be read,
+// checked and verified in turn. With one socket, only 0.
 //
-void do_blank()
+bool
+do_gang()
 {
-    uint16_t addr;
-    char ads[32];
+    uint8_t g = (uint8_t) (pop() - '0');
+    
+    if (g >= GANG_SOCKETS) {
+        uart_puts("bad socket");
+        return false;
+    }
+    gangRead = g;
+    uart_puts("OK");
+    return true;
+}
+
+// ****************************************************************************
+// Set the transfer mode. Reply OK if we support it, so the host can
+// negotiate binary transfers and fall back to ascii if not.
+//
+bool
+do_mode()
+{
+    uint8_t m = get_hex8();
+    
+    if (m & ~MODE_ALL) {
+        uart_puts("bad mode");
+        return false;
+    }
+    mode = m;
+    uart_puts("OK");
+    return true;
+}
+
+// ****************************************************************************
+// high priority service routine for UART receive and transmit
+//
+void __interrupt() isr(void)
+{
+        char c = 0;
+
+        // Get the character from uart. Not while uart_init_brg() has
+        // receive interrupts off, it reads the auto baud char itself.
+        uint8_t status = PIE1bits.RCIE ? uart_getc(&c) : UART_NONE;
+        bool    ok     = status == UART_OK;
+        
+        if (ok) {
+            stats.received++;
+        }
+        else if (status == UART_FERR) {
+            stats.ferr++;
+        }
+        else if (status == UART_OERR) {
+            stats.oerr++;
+        }
+        
+        // A BREAK from the host is a framing error with the data all 0 and
+        // RX held low after it. No data can look like one, even binary, so
+        // it is the abort: stop any program pulse and turn VPP off now,
+        // then the cmd sees cmd_active is false and stops, and main
+        // replies. Until the line is quiet again nothing is queued, it is
+        // the rest of what the host was sending.
+        if (status == UART_FERR && c == 0 && PORTCbits.RC7 == 0) {
+            cmd_active      = false;
+            aborted         = true;
+            CCP1CON         = 0;   // RC2 back to LATC, which is inactive
+            PIR1bits.CCP1IF = 1;   // so the wait for the pulse ends
+            LATCbits.LATC1  = 1;   // WE_ high, VPP off
+        }
+        
+        // Between cmds, a 'U' is the host's init. If we started at the
+        // stored rate and the host's first char is anything but a '$' or
+        // 'U', it is at another rate, so go back to auto baud.
+        if (!cmd_active && !aborted && empty() && status != UART_NONE) {
+            if (ok && (c == '$' || c == CMD_INIT)) {
+                linkStored = false;
+                if (c == CMD_INIT) {
+                    linkReq = LINK_REPLY;
+                }
+            }
+            else if (linkStored && status != UART_OERR) {
+                linkStored = false;
+                linkReq    = LINK_AUTO;
+            }
+        }
+        
+        // Between cmds, ignore anything but the '$' that starts one, such
+        // as the CR LF after an Intel HEX EOF record.
+        if (ok && !aborted && (cmd_active || !empty() || c == '$')) {
+            // Push the char onto stack
+            push(c);
+
+            // Check if we have a cmd yet. 
+            if ( (first() == '$') && size() > 1) {
+                // We have a command (2 chars at head of queue))
+                cmd_active = true;
+            }
+        }
+        
+        // Send the next char, if any
+        uart_tx_isr();
+        
+        // mS tick
+        if (INTCONbits.TMR0IF) {
+            INTCONbits.TMR0IF = 0;
+            TMR0 += TMR0_RELOAD;
+            ticks++;
+            led_tick();
+        }
+}
+
+// ****************************************************************************
+// Set the control pins on port C to p, leaving the LEDs alone.
+// The isr may change the LEDs, so don't let it in between reading and
+// writing LATC. Once aborted, VPP is kept off whatever the cmd asks.
+//
+void set_pins(uint8_t p)
+{
+    if (aborted) {
+        p |= PIN_WE;               // VPP stays off
+    }
+    INTCONbits.GIE = 0;
+    LATC = (LATC & ~PIN_MASK) | p;
+    INTCONbits.GIE = 1;
+}
+
+// ****************************************************************************
+// Enable the control lines of the sockets in mask, and gate the others
+// off. Each is one bit set or clear, so the isr can't get in between.
+//
+void gang_select(uint8_t mask)
+{
+#if GANG_SOCKETS > 1
+    LATEbits.LATE2 = (mask & 0x01) != 0;
+    LATCbits.LATC5 = (mask & 0x02) != 0;
+#endif
+}
+
+// ****************************************************************************
+// Drop socket g from the write, as it failed. The caller then says why.
+//
+void gang_drop(uint8_t g)
+{
+    gangLive &= ~(1 << g);
+    gangFail |= 1 << g;
+#if GANG_SOCKETS > 1
+    uart_puts("Socket ");
+    uart_putc('0' + g);
+    uart_puts(": ");
+#endif
+}
+
+// ****************************************************************************
+// Busy wait for n loops, see NS()
+//
+void wait_loops(uint8_t n)
+{
+    while (n--) {
+        NOP();
+    }
+}
+
+// ****************************************************************************
+// Set the address on ports A and B
+//
+void setup_address(uint16_t addr)
+{                
+    // Set the address lines. B0-7 is A0-7, A0-2 is A8-11
+    // RA4 is CTS, which the isr may change, so don't let it in
+    // between reading and writing LATA.
+    uint8_t hi = addr >> 8;
+    LATB       = addr & 0xff;
+    INTCONbits.GIE = 0;
+    LATA       = (LATA & 0xf0) | (hi & 0x0f);
+    INTCONbits.GIE = 1;
+    
+    // The wait for the address to settle is in read_port() and
+    // write_port(), as it depends on the device.
+}
+
+// ****************************************************************************
+// Move the address lines on to addr, one after the last address set. Only
+// A0-7 change, except on a page crossing, so only then is LATA touched.
+// Call setup_address() for the first address of a range.
+//
+void next_address(uint16_t addr)
+{
+    uint8_t lo = addr & 0xff;
+    
+    if (lo == 0) {
+        setup_address(addr);
+    }
+    else {
+        LATB = lo;
+    }
+}
+
+// ****************************************************************************
+// Read a byte from port D. Assume the control pins are set for reading.
+//
+uint8_t read_port()
+{
+    // Set port D to input to read from DUT
+    if (TRISD != INPUT) {
+        TRISD = INPUT;
+        wait_loops(dev->tOE);
+    }
+    
+    // wait, Tacc
+    wait_loops(dev->tACC);
+
+    // Read port D
+    uint8_t data = PORTD;
+    
+    return data;
+}
+
+// ****************************************************************************
+// Set control bits for reading. Port D is made an input first, so it is
+// never driven by us and the EPROM at once.
+//
+void read_start()
+{
+    TRISD = INPUT;
+    gang_select(1 << gangRead);
+    set_pins(dev->readPins);
+}
+
+// ****************************************************************************
+// Set outputs disabled after reading
+//
+void read_end()
+{
+    set_pins(dev->idlePins);
+}
+
+// ****************************************************************************
+// Init uart baud rate
+//
+void do_init()
+{
+    uint16_t rate;
+        
+    rate = uart_init_brg();
+    config_save();
+    
+    put_dec(rate);
+    uart_putc('\n');
+}
+
+// ****************************************************************************
+// Drop everything the host sends until the line has been quiet for
+// QUIET_MS. Send the reply first, so the window starts once it is out.
+// Frames still in flight may hold a '$' and a cmd char, so nothing is
+// kept until the host has stopped sending. A 0x55 in the data dropped
+// looks like a 'U' to the isr, so forget any link request made meanwhile.
+//
+void wait_quiet()
+{
+    uint16_t n;
+    uint16_t t0;
+    
+    uart_flush();
+    do {
+        clear();
+        n  = stats.ferr + (uint16_t) stats.received;
+        t0 = get_ticks();
+        while (get_ticks() - t0 < QUIET_MS) {
+            NOP();
+        }
+    } while (n != stats.ferr + (uint16_t) stats.received);
+    linkReq = LINK_NONE;
+}
+
+// ****************************************************************************
+// The host isn't talking at the stored rate. Let the rest of its 'U' go by,
+// then auto baud on the next one it sends.
+//
+void do_reinit()
+{
+    ledMode = LED_INIT;
+    wait_quiet();
+    do_init();
+}
+
+// ****************************************************************************
+// Finish an abort. The cmd may have stopped anywhere, so put everything
+// as it is between cmds, then reply ABORT straight away. The rest of
+// the aborted cmd's data is dropped until the line goes quiet.
+//
+void abort_end(char cmd)
+{
+    T1CONbits.TMR1ON = 0;
+    CCP1CON   = 0;
+    rxPending = 0;
+    set_pins(dev->idlePins);
+    TRISD = INPUT;
+    trace_event(TR_ABORT, cmd);
+    uart_puts("ABORT\n");
+    uart_flush();
+    aborted = false;
+    wait_quiet();
+}
+
+// ****************************************************************************
+// Change the baud rate. We reply OK at the old rate, then switch and wait
+// for the host to send a 'U' at the new rate. If it comes, we reply OK at
+// the new rate. If not, we go back to the old rate and reply FAIL there.
+//
+bool do_baud()
+{
+    uint8_t  i   = charToHexDigit(pop());
+    uint16_t old = uart_get_brg();
+    uint16_t t0;
+    
+    if (i >= NBAUDS) {
+        uart_puts("bad baud");
+        return false;
+    }
+    uart_puts("OK");
+    uart_set_baud(i);
+    
+    // Wait up to a second for the host to try the new rate. We are still
+    // in the cmd, so the isr queues the 'U'.
+    clear();
+    cmd_active = true;
+    t0 = get_ticks();
+    while (empty() && get_ticks() - t0 < 1000) {
+        NOP();
+    }
+    if (!empty() && pop() == 'U') {
+        uart_puts("OK");
+        config_save();
+        return true;
+    }
+    
+    uart_set_brg(old);
+    clear();
+    uart_puts("FAIL");
+    return false;
+}
+
+// ****************************************************************************
+// check eprom is wiped clean
+// Timing critical code. At 20MHz xtal clock, each instruction = 200nS
+//
+bool do_blank()
+{
+    uint16_t addr;
     bool ok = true;
        
     // Set control bits for reading
-    if (devType == DEV_2716) {
-        LATCbits.LATC0 = 0; // Set CS_ true
-        LATCbits.LATC2 = 0; // Set PD/PGM lo
-    } 
-    else if (devType == DEV_2732) {
-        LATCbits.LATC0 = 0; // Set G_/VPP lo
-        LATCbits.LATC2 = 0; // Set E_ true
-    }
-    else if (devType == DEV_2532) {
-        LATCbits.LATC2 = 0; // Set PD/PGM_ lo
-    }
+    read_start();
+    setup_address(0);
         
     for (addr = 0; addr < bytes; ++addr) {
         if (cmd_active == false) {
             uart_puts("Check aborted\n");
-            return;
+            return false;
         }
 
-        // Latch the 16 bit address.
-        setup_address(addr);
+        // Move on to the address.
+        next_address(addr);
         
         // Read port D
         uint8_t data = read_port();
                       
         if (data != 0xff) {
-            uart_puts("Erase check fail at address ");
-            sprintf(ads, "0x%04x = ", addr);
-            uart_puts(ads);
-            sprintf(ads, "0x%02x\n", data);
-            uart_puts(ads);
+            uart_puts("Erase check fail at address 0x");
+            put_hex16(addr);
+            uart_puts(" = 0x");
+            put_hex8(data);
+            uart_putc('\n');
             ok = false;
             break;
         }
     }
     
-    // Set outputs disabled
-    if (devType == DEV_2716) {
-        LATCbits.LATC0 = 1; // Set CS_ true
-        LATCbits.LATC2 = 0; // Set PD/PGM lo
-    } 
-    else if (devType == DEV_2732) {
-        LATCbits.LATC0 = 1; // Set G_/VPP hi
-        LATCbits.LATC2 = 1; // Set E_ false
-    }
-    else if (devType == DEV_2532) {
-        LATCbits.LATC2 = 1; // Set PD/PGM_ hi
+    // Set outputs disabled
+    read_end();
+    
+    if (ok) {
+        uart_puts("OK");
+    }
+    return ok;
+}
+
+// ****************************************************************************
+// fast check eprom is wiped clean. Rather than stop at the first failure,
+// we check the whole device and reply with a map of the 256 byte pages
+// that aren't blank (bit 0 = page 0) and the number of bytes that aren't
+// 0xff, as "mmmm nnnn". So "0000 0000" is a blank chip.
+// We only switch port D and the control bits once, and only set the
+// high address bits when they change.
+//
+bool do_blank_map()
+{
+    uint16_t addr;
+    uint16_t map   = 0;
+    uint16_t count = 0;
+    uint16_t bit   = 1;
+    
+    // Set control bits for reading
+    read_start();
+    TRISD = INPUT;
+    setup_address(0);
+       
+    for (addr = 0; addr < bytes; ++addr) {
+        uint8_t lo = addr & 0xff;
+        
+        if (lo == 0 && cmd_active == false) {
+            read_end();
+            uart_puts("Check aborted\n");
+            return false;
+        }
+        next_address(addr);
+        
+        // wait, Tacc
+        wait_loops(dev->tACC);
+        
+        if (PORTD != 0xff) {
+            map |= bit;
+            count++;
+        }
+        if (lo == 0xff) {
+            bit <<= 1;
+        }
+    }
+    
+    // Set outputs disabled
+    read_end();
+    
+    put_hex16(map);
+    uart_putc(' ');
+    put_hex16(count);
+    return true;
+}
+
+// ****************************************************************************
+// CRC16 of a range of eprom, so the host can check a chip against an image
+// without reading it back. Replies with the CRC as 4 hex digits.
+//
+bool do_crc()
+{
+    uint16_t start;
+    uint16_t len;
+    uint16_t crc   = 0xffff;
+    uint16_t addr;
+    
+    if (!get_range(&start, &len)) {
+        return false;
+    }
+    
+    // Set control bits for reading
+    read_start();
+    setup_address(start);
+    
+    for (addr = start; addr < start + len; ++addr) {
+        if (cmd_active == false) {
+            read_end();
+            uart_puts("CRC aborted\n");
+            return false;
+        }
+        
+        // Move on to the address.
+        next_address(addr);
+        
+        crc = crc16(crc, read_port());
+    }
+    
+    // Set outputs disabled
+    read_end();
+    
+    put_hex16(crc);
+    return true;
+}
+
+// ****************************************************************************
+// Verify against an image without reading it all back. The host sends the
+// CRC16 of each PAGESIZE page of its image, as CMD_CRC would give, 4 hex
+// digits each, and we send back only the pages that differ. In binary
+// mode each is a 2 byte frame with the page address, hi first, then its
+// data in READFRAME frames. In ascii mode it is lines as CMD_READ sends.
+// Either way an empty frame, or an empty line, ends the reply.
+//
+bool do_verify_pages()
+{
+    uint16_t page;
+    uint16_t crc;
+    uint16_t i;
+    
+    // Set control bits for reading
+    read_start();
+    setup_address(0);
+    
+    for (page = 0; page < bytes; page += PAGESIZE) {
+        uint16_t want = get_hex16();
+        
+        if (cmd_active == false) {
+            read_end();
+            uart_puts("Verify aborted\n");
+            return false;
+        }
+        
+        // Read the page into buffer, so if it differs we can send it
+        crc = 0xffff;
+        for (i = 0; i < PAGESIZE; ++i) {
+            next_address(page + i);
+            buffer[i] = read_port();
+            crc = crc16(crc, buffer[i]);
+        }
+        if (crc == want) {
+            continue;
+        }
+        
+        if (mode & MODE_BINARY) {
+            frame[0] = page >> 8;
+            frame[1] = page & 0xff;
+            send_frame(frame, 2);
+            for (i = 0; i < PAGESIZE; i += READFRAME) {
+                send_frame(buffer + i, READFRAME);
+            }
+        }
+        else {
+            for (i = 0; i < PAGESIZE; i += READROW) {
+                put_row(page + i, buffer + i, READROW);
+            }
+        }
+    }
+    
+    // Set outputs disabled
+    read_end();
+    
+    if (mode & MODE_BINARY) {
+        send_frame(frame, 0);
+    }
+    else {
+        uart_putc('\n');
+    }
+    return true;
+}
+
+// ****************************************************************************
+// read from eprom
+// Timing critical code. At 20MHz xtal clock, each instruction = 200nS
+//
+bool do_read()
+{
+    uint16_t addr;
+    uint8_t col=0;
+    
+    // Set control bits for reading
+    read_start();
+    setup_address(0);
+        
+    for (addr = 0; addr < bytes; ++addr) {
+        if (cmd_active == false) {
+            uart_puts("Read aborted\n");
+            return false;
+        }
+        
+        // Move on to the address.
+        next_address(addr);
+    
+        // Read port D
+        uint8_t data = read_port();
+        
+        // Send a frame, or a line of hex, when it is full.
+        frame[col++] = data;
+        if (mode & MODE_BINARY) {
+            if (col == READFRAME) {
+                send_frame(frame, col);
+                col = 0;
+            }
+        }
+        else if (col == READROW) {
+            put_row(addr - (READROW-1), frame, col);
+            col = 0;
+        }
+    }
+    
+    // Flush the last binary frame, then an empty frame to end.
+    if (mode & MODE_BINARY) {
+        if (col > 0) {
+            send_frame(frame, col);
+        }
+        send_frame(frame, 0);
+    }
+    
+    // Set outputs disabled
+    read_end();
+    return true;
+}
+
+// ****************************************************************************
+// Send the n bytes of packed data in frame. In binary mode as a frame,
+// in ascii mode as a line of hex digits, so n of 0 ends the data.
+//
+void pack_send(uint8_t n)
+{
+    uint8_t i;
+    
+    if (mode & MODE_BINARY) {
+        send_frame(frame, n);
+    }
+    else {
+        for (i = 0; i < n; ++i) {
+            put_hex8(frame[i]);
+        }
+        uart_putc('\n');
+    }
+}
+
+// ****************************************************************************
+// Add a byte to the packed data in frame, sending it when full.
+//
+void pack_put(uint8_t *n, uint8_t b)
+{
+    frame[(*n)++] = b;
+    if (*n == READFRAME) {
+        pack_send(*n);
+        *n = 0;
+    }
+}
+
+// ****************************************************************************
+// Read a byte, with the address setup time.
+//
+uint8_t read_at(uint16_t addr)
+{
+    setup_address(addr);
+    return read_port();
+}
+
+// ****************************************************************************
+// Read a range packed as runs, which mostly makes the 0xFF of a part
+// programmed EPROM free to send. A control byte c < 0x80 is followed by
+// c+1 literal bytes, and c >= 0x80 by one byte to repeat c-0x7e times,
+// so 2 to 129. We only pack runs of 3 or more. The host unpacks with
+//
+//     while (more) {
+//         c = next();
+//         if (c < 0x80) copy(c + 1);
+//         else          fill(next(), c - 0x7e);
+//     }
+//
+// In binary mode the packed data is sent in frames, ending with an empty
+// frame, as CMD_READ. In ascii mode each frame is a line of hex digits,
+// ending with an empty line. Args are as CMD_CRC.
+//
+bool do_read_packed()
+{
+    uint16_t start;
+    uint16_t len;
+    uint16_t addr;
+    uint16_t end;
+    uint8_t  n = 0;                // bytes in frame
+    uint8_t  b;
+    uint8_t  run;
+    uint8_t  lit;
+    uint8_t  same;                 // equal bytes at the end of the literals
+    uint8_t  i;
+    
+    if (!get_range(&start, &len)) {
+        return false;
+    }
+    end = start + len;
+    
+    // Set control bits for reading
+    read_start();
+    
+    addr = start;
+    while (addr < end) {
+        if (cmd_active == false) {
+            uart_puts("Read aborted\n");
+            return false;
+        }
+        
+        // A run at addr?
+        b   = read_at(addr);
+        run = 1;
+        while (run < PACK_REP && run < end - addr && read_at(addr + run) == b) {
+            ++run;
+        }
+        if (run >= 3) {
+            pack_put(&n, 0x7e + run);
+            pack_put(&n, b);
+            addr += run;
+            continue;
+        }
+        
+        // Else literals, into buffer, up to the next run of 3
+        lit  = 0;
+        same = 0;
+        while (lit < PACK_LIT && lit < end - addr) {
+            buffer[lit] = read_at(addr + lit);
+            same = (lit > 0 && buffer[lit] == buffer[lit - 1]) ? same + 1 : 1;
+            ++lit;
+            if (same == 3) {
+                lit -= 3;
+                break;
+            }
+        }
+        pack_put(&n, lit - 1);
+        for (i = 0; i < lit; ++i) {
+            pack_put(&n, buffer[i]);
+        }
+        addr += lit;
+    }
+    
+    // The last frame, then an empty one to end
+    if (n > 0) {
+        pack_send(n);
+    }
+    pack_send(0);
+    
+    // Set outputs disabled
+    read_end();
+    return true;
+}
+
+// ****************************************************************************
+// Start receiving a block of need bytes into buf. If ack, BLOCK_ACK is
+// sent when it is complete.
+//
+void rx_start(rxblock_t *rx, uint8_t *buf, uint16_t need, bool ack)
+{
+    rx->buf    = buf;
+    rx->need   = need;
+    rx->got    = 0;
+    rx->state  = (mode & MODE_BINARY) ? RX_LEN : RX_HI;
+    rx->status = RX_MORE;
+    rx->ack    = ack;
+}
+
+// ****************************************************************************
+// Add a received char to the block.
+//
+uint8_t rx_feed(rxblock_t *rx, uint8_t c)
+{
+    switch (rx->state) {
+        case RX_HI:
+            rx->buf[rx->got] = charToHexDigit(c) << 4;
+            rx->state = RX_LO;
+            return RX_MORE;
+        case RX_LO:
+            rx->buf[rx->got++] |= charToHexDigit(c);
+            rx->state = RX_HI;
+            break;
+        case RX_LEN:
+            if (c == 0 || c > rx->need - rx->got) {
+                return RX_BAD;
+            }
+            rx->left  = c;
+            rx->sum   = c;
+            rx->state = RX_DATA;
+            return RX_MORE;
+        case RX_DATA:
+            rx->buf[rx->got++] = c;
+            rx->sum += c;
+            if (--rx->left == 0) {
+                rx->state = RX_SUM;
+            }
+            return RX_MORE;
+        case RX_SUM:
+            if ((uint8_t) (rx->sum + c) != 0) {
+                return RX_BAD;
+            }
+            rx->state = RX_LEN;
+            break;
+    }
+    return rx->got == rx->need ? RX_DONE : RX_MORE;
+}
+
+// ****************************************************************************
+// Feed the block the next char from the queue, waiting for it if need be.
+//
+void rx_next(rxblock_t *rx)
+{
+    rx->status = rx_feed(rx, (uint8_t) pop());
+    if (rx->status == RX_DONE && rx->ack) {
+        uart_putc(BLOCK_ACK);
+    }
+}
+
+// ****************************************************************************
+// Feed the block whatever is in the queue now, without waiting.
+//
+void rx_poll(rxblock_t *rx)
+{
+    while (rx->status == RX_MORE && !empty()) {
+        rx_next(rx);
+    }
+}
+
+// ****************************************************************************
+// Feed the block until it is complete, or bad.
+//
+void rx_wait(rxblock_t *rx)
+{
+    while (rx->status == RX_MORE) {
+        rx_next(rx);
+    }
+}
+
+// ****************************************************************************
+// Start a program pulse of ms milliseconds on RC2, timed by Timer1 and
+// CCP1 in compare mode. The mode write drives the pin active, and the
+// match drives it inactive again. Assume address and data setup.
+//
+void pulse_start(uint8_t ms)
+{
+    T1CONbits.TMR1ON = 0;
+    TMR1H  = 0;
+    TMR1L  = 0;
+    uint16_t n = (uint16_t) ms * TMR1_PER_MS;
+    CCPR1H = n >> 8;
+    CCPR1L = n & 0xff;
+    PIR1bits.CCP1IF = 0;
+    
+    // PGM is high between pulses for the 2732 and 2532, so pulse low.
+    CCP1CON = (dev->progPins & PIN_PGM) ? CCP_LO_HI : CCP_HI_LO;
+    T1CONbits.TMR1ON = 1;
+}
+
+// ****************************************************************************
+// Finish a program pulse, and give RC2 back to LATC, which already has
+// the inactive level from progPins.
+//
+void pulse_end()
+{
+    while (!PIR1bits.CCP1IF) {
+        NOP();
+    }
+    T1CONbits.TMR1ON = 0;
+    CCP1CON = 0;
+}
+
+// ****************************************************************************
+// Give a program pulse of ms milliseconds. Assume address and data setup.
+// The pulse is timed in hardware, so while it runs we're free to take
+// the next data from the queue. None once aborted.
+//
+void pgm_pulse(uint8_t ms)
+{
+    if (aborted) {
+        return;
+    }
+    
+    // Activate PGM pulse
+    wait_loops(dev->tAS);
+    pulse_start(ms);
+    stats.pulseMs += ms;
+    while (!PIR1bits.CCP1IF) {
+        if (rxPending) {
+            rx_poll(rxPending);
+        }
+    }
+
+    // Deactivate PGM pulse
+    pulse_end();
+    __delay_us(2);
+}
+
+// ****************************************************************************
+// Read back a byte while programming, then restore the program state.
+// Port D turns round before the outputs are enabled, as in read_start().
+//
+uint8_t verify_port()
+{
+    TRISD = INPUT;
+    wait_loops(dev->tOE);
+    set_pins(dev->verifyPins);
+    uint8_t data = read_port();
+    
+    set_pins(dev->progPins);
+    TRISD = OUTPUT;
+    
+    return data;
+}
+
+// ****************************************************************************
+// Write a byte. Assume address setup and D is output.
+//
+void write_port(uint8_t data)
+{   
+    // Write the byte to port D
+     __delay_us(2);
+    LATD = data;
+
+    pgm_pulse(dev->pulseMs);
+}
+
+// ****************************************************************************
+// Write a byte with the fast algorithm: 1mS pulses until the byte reads
+// back, then an overprogram pulse of 3mS per pulse it took. Ganged
+// sockets that read back get no more 1mS pulses, and the overprogram
+// pulse is for the slowest. Returns the sockets the byte read back in.
+//
+uint8_t write_fast(uint8_t data)
+{
+    uint8_t n;
+    uint8_t g;
+    uint8_t left = gangLive;       // sockets still to read back
+    uint8_t most = 0;              // pulses the slowest one took
+    
+    for (n = 1; n <= dev->fastMax && left != 0; ++n) {
+        gang_select(left);
+        __delay_us(2);
+        LATD = data;
+        pgm_pulse(1);
+        
+        for (g = 0; g < GANG_SOCKETS; ++g) {
+            if (left & (1 << g)) {
+                gang_select(1 << g);
+                if (verify_port() == data) {
+                    left &= ~(1 << g);
+                    most  = n;
+                }
+            }
+        }
+    }
+    
+    gang_select(gangLive & ~left);
+    if (most > 0) {
+        LATD = data;
+        pgm_pulse(3*most);
+    }
+    return gangLive & ~left;
+}
+
+// ****************************************************************************
+// Read back a byte just programmed, for MODE_VERIFY, from each live
+// socket, and list it where it is wrong. Returns false when the list is
+// full, as the chip is bad and there's no point going on.
+//
+bool verify_byte(uint16_t addr, uint8_t data)
+{
+    uint8_t g;
+    uint8_t d;
+    
+    for (g = 0; g < GANG_SOCKETS && verifyErrs < VERIFY_MAX; ++g) {
+        if ((gangLive & (1 << g)) == 0) {
+            continue;
+        }
+        gang_select(1 << g);
+        d = verify_port();
+        if (d != data) {
+            verifyAddr[verifyErrs] = addr;
+            verifyData[verifyErrs] = d;
+#if GANG_SOCKETS > 1
+            verifySock[verifyErrs] = g;
+#endif
+            verifyErrs++;
+        }
+    }
+    gang_select(gangLive);
+    return verifyErrs < VERIFY_MAX;
+}
+
+// ****************************************************************************
+// Report a byte that would not program.
+//
+void write_fail(uint16_t addr)
+{
+    uart_puts("Write fail at address 0x");
+    put_hex16(addr);
+    uart_putc('\n');
+}
+
+// ****************************************************************************
+// Report a bit that is 0 in the EPROM but 1 in the data. Only erasing can
+// make it 1 again, so no amount of programming will help.
+//
+void conflict_fail(uint16_t addr)
+{
+    uart_puts("Conflict at address 0x");
+    put_hex16(addr);
+    uart_putc('\n');
+}
+
+// ****************************************************************************
+// Can data be programmed at addr? Not if a bit needs to go from 0 to 1.
+// Each live socket is checked, and dropped with the conflict reported if
+// it can't. False if none can.
+//
+bool cell_ok(uint16_t addr, uint8_t data)
+{
+    uint8_t g;
+    
+    setup_address(addr);
+    for (g = 0; g < GANG_SOCKETS; ++g) {
+        if (gangLive & (1 << g)) {
+            gang_select(1 << g);
+            if ((verify_port() & data) != data) {
+                gang_drop(g);
+                conflict_fail(addr);
+            }
+        }
+    }
+    gang_select(gangLive);
+    return gangLive != 0;
+}
+
+// ****************************************************************************
+// Check a range before any of it is programmed, and report the first
+// conflict. In skip mode 0xFF isn't checked, it is a gap.
+//
+bool check_range(const uint8_t *data, uint16_t start, uint16_t n, bool skipFF)
+{
+    uint16_t i;
+    
+    for (i = 0; i < n; ++i) {
+        if (skipFF && data[i] == 0xff) {
+            continue;
+        }
+        if (!cell_ok(start + i, data[i])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// ****************************************************************************
+// Write a byte at addr using the selected algorithm, and report it if it
+// fails. The cell is read first, so a chip that isn't erased is stopped
+// at the first conflict rather than after the host verifies. Classic
+// pulses then always pass unless MODE_VERIFY reads them back. In skip
+// mode 0xFF is neither checked nor written, as in check_range().
+//
+bool write_byte(uint16_t addr, uint8_t data)
+{
+    uint8_t g;
+    
+    if ((mode & MODE_SKIPFF) && data == 0xff) {
+        return true;
+    }
+    if (!cell_ok(addr, data)) {
+        return false;
+    }
+    
+    if ((mode & MODE_FAST) && dev->fastMax > 0) {
+        uint8_t done = write_fast(data);
+        if (cmd_active == false) {
+            // aborted, it didn't fail
+            return false;
+        }
+        for (g = 0; g < GANG_SOCKETS; ++g) {
+            if ((gangLive & ~done) & (1 << g)) {
+                gang_drop(g);
+                write_fail(addr);
+            }
+        }
+        if (gangLive == 0) {
+            return false;
+        }
+    }
+    else {
+        write_port(data);
+    }
+    
+    if (cmd_active == false) {
+        return false;
+    }
+    if (mode & MODE_VERIFY) {
+        return verify_byte(addr, data);
+    }
+    return true;
+}
+
+// ****************************************************************************
+// Receive up to len bytes into buf. In ascii mode exactly len bytes,
+// in binary mode frames until an empty frame. Returns false, with the
+// reply sent, if a frame is bad or there are too many bytes.
+//
+bool recv_range(uint8_t *buf, uint16_t len, uint16_t *got)
+{
+    uint16_t i = 0;
+    
+    if (mode & MODE_BINARY) {
+        uint8_t n;
+        uint8_t max;
+        while (true) {
+            max = frame_max(len - i);
+            if (!recv_frame(buf + i, max, &n)) {
+                frame_error(n, max);
+                return false;
+            }
+            if (n == 0) {
+                break;
+            }
+            i += n;
+        }
+    }
+    else {
+        for (i = 0; i < len; ++i) {
+            buf[i] = get_hex8();
+        }
+    }
+    *got = i;
+    return true;
+}
+
+// ****************************************************************************
+// Program n bytes of data at start in passes, each pass pulsing every
+// byte once. Returns false if aborted.
+//
+bool run_passes(const uint8_t *data, uint16_t start, uint16_t n, bool skipFF)
+{
+    uint16_t i;
+    uint8_t  pass;
+    
+    // Many passes take a long time, so check it can work first.
+    if (!check_range(data, start, n, skipFF)) {
+        return false;
+    }
+    
+    for (pass = 0; pass < dev->passes; ++pass) {
+        for (i = 0; i < n; ++i) {
+            if (cmd_active == false) {
+                uart_puts("Write aborted\n");
+                return false;
+            }
+            if (skipFF && data[i] == 0xff) {
+                continue;
+            }
+            setup_address(start + i);
+            write_port(data[i]);
+            
+            // Only after the last pass will it read back
+            if ((mode & MODE_VERIFY) && pass == dev->passes - 1 &&
+                !verify_byte(start + i, data[i])) {
+                return false;
+            }
+        }
+        trace_event(TR_BLOCK, start + n);
+    }
+    return true;
+}
+
+// ****************************************************************************
+// Program a range in passes, for the 2708. Each pass pulses every byte
+// once, so we receive it all into buffer first and then each pass runs
+// at the full pulse rate.
+//
+bool write_passes(uint16_t start, uint16_t len)
+{
+    uint16_t n;
+    
+    if (!recv_range(buffer, len, &n)) {
+        return false;
     }
+    return run_passes(buffer, start, n, (mode & MODE_SKIPFF) != 0);
+}
+
+// ****************************************************************************
+// Start a write, with all the sockets live and nothing failed yet, and
+// port D and the control pins set for programming. Every write starts
+// here, so they all go into the program state the same way.
+//
+void write_start()
+{
+    verifyErrs = 0;
+    gangLive   = GANG_ALL;
+    gangFail   = 0;
+    gang_select(gangLive);
     
-    if (ok) {
+    // Set port D to output. The outputs are disabled from idlePins, so
+    // it is ours.
+    TRISD = OUTPUT;
+      
+    // Set control bits for writing 
+    set_pins(dev->progPins);
+}
+
+// ****************************************************************************
+// Finish a write. Set the outputs disabled and VPP off, and reply OK, or
+// the MODE_VERIFY errors as "Verify errors n: aaaa=dd ..." with the
+// address and what read back for each. Ganged, each is "s:aaaa=dd" with
+// the socket, and if any socket was dropped, "Failed sockets mm\n" with
+// a bit for each follows. True if it all programmed.
+//
+bool write_end(bool ok)
+{
+    uint8_t i;
+    
+    set_pins(dev->idlePins);
+    TRISD = INPUT;
+    
+    if (verifyErrs > 0) {
+        uart_puts("Verify errors ");
+        put_dec(verifyErrs);
+        uart_putc(':');
+        for (i = 0; i < verifyErrs; ++i) {
+            uart_putc(' ');
+#if GANG_SOCKETS > 1
+            uart_putc('0' + verifySock[i]);
+            uart_putc(':');
+#endif
+            put_hex16(verifyAddr[i]);
+            uart_putc('=');
+            put_hex8(verifyData[i]);
+        }
+        uart_putc('\n');
+    }
+#if GANG_SOCKETS > 1
+    if (gangFail != 0) {
+        uart_puts("Failed sockets ");
+        put_hex8(gangFail);
+        uart_putc('\n');
+    }
+#endif
+    if (ok && verifyErrs == 0 && gangFail == 0) {
         uart_puts("OK");
-    }  
+    }
+    return ok && verifyErrs == 0 && gangFail == 0;
 }
 
 // ****************************************************************************
-// read from eprom
+// write len bytes to eprom from address start.
+// In ascii mode we read exactly len bytes, in binary mode frames until an
+// empty frame, which may be fewer bytes than len but not more.
 // Timing critical code. At 20MHz xtal clock, each instruction = 200nS
 //
-void do_read()
+bool write_range(uint16_t start, uint16_t len)
 {
     uint16_t addr;
-    char ads[16];
-    uint8_t col=0;
+    uint16_t end = start + len;
+    uint8_t  i;
+    bool     ok = true;
     
-    // Set control bits for reading
-    if (devType == DEV_2716) {
-        LATCbits.LATC0 = 0; // Set CS_ true
-        LATCbits.LATC2 = 0; // Set PD/PGM lo
-    } 
-    else if (devType == DEV_2732 ) {
-        LATCbits.LATC0 = 0; // Set G_/VPP lo
-        LATCbits.LATC2 = 0; // Set E_ true
+    write_start();
+    
+    // Wait for a couple of chars before starting
+    for (i = 0; i < 200 && cmd_active; ++i) {
+        __delay_ms(1);
     }
-    else if (devType == DEV_2532) {
-        LATCbits.LATC2 = 0; // Set PD/PGM_ lo
+    
+    if (dev->passes > 1) {
+        ok = write_passes(start, len);
     }
-        
-    for (addr = 0; addr < bytes; ++addr) {
-        if (cmd_active == false) {
-            uart_puts("Read aborted\n");
-            return;
+    else if (mode & MODE_BINARY) {
+        // Binary frames until an empty frame.
+        uint8_t n;
+        uint8_t max;
+        addr = start;
+        while (true) {
+            if (cmd_active == false) {
+                uart_puts("Write aborted\n");
+                return false;
+            }
+            max = frame_max(end - addr);
+            if (!recv_frame(buffer, max, &n)) {
+                frame_error(n, max);
+                ok = false;
+                break;
+            }
+            if (n == 0) {
+                break;
+            }
+            for (i = 0; i < n && ok; ++i) {
+                ok = write_byte(addr++, buffer[i]);
+            }
+            if (!ok) {
+                break;
+            }
+            trace_event(TR_BLOCK, addr);
         }
+    } 
+    else {
+        // The next byte is decoded from the queue during the pulse.
+        rxblock_t rx;
+        uint8_t   next;
         
-        // Latch the 16 bit address.
-        setup_address(addr);
-    
-        // Read port D
-        uint8_t data = read_port();
-        
-        // Write address
-        if (col == 0) {
-            sprintf(ads, "%04x: ", addr);
-            uart_puts(ads);
-        }
-        // Write data
-        sprintf(ads, "%02x", data);
-        uart_puts(ads);
-        if (col == 15) {
-            col = 0;
-            uart_putc('\n');
-        } else {
-            uart_putc(' ');
-            col++;
+        if (start < end) {
+            rx_start(&rx, &next, 1, false);
+        }
+        for (addr = start; addr < end; addr++) {
+            if (cmd_active == false) {
+                uart_puts("Write aborted\n");
+                return false;
+            }
+
+            // Get two ascii chars from queue and convert to 8 bit data,
+            // if the last pulse didn't.
+            rx_wait(&rx);
+            uint8_t data = next;
+            if (addr + 1 < end) {
+                rx_start(&rx, &next, 1, false);
+                rxPending = &rx;
+            }
+
+            // Write the byte at the address
+            ok = write_byte(addr, data);
+            rxPending = 0;
+            if (!ok) {
+                break;
+            }
+            if ((addr & 0xff) == 0xff) {
+                trace_event(TR_BLOCK, addr + 1);
+            }
         }
     }
     
-    // Set outputs disabled
-    if (devType == DEV_2716) {
-        LATCbits.LATC0 = 1; // Set CS_ true
-        LATCbits.LATC2 = 0; // Set PD/PGM lo
-    } 
-    else if (devType == DEV_2732) {
-        LATCbits.LATC0 = 1; // Set G_/VPP hi
-        LATCbits.LATC2 = 1; // Set E_ false
-    }
-    else if (devType == DEV_2532) {
-        LATCbits.LATC2 = 1; // Set PD/PGM_ hi )
-    }
+    return write_end(ok);
 }
 
 // ****************************************************************************
-// Write a byte. Assume address setup and D is output.
+// write to eprom from address 0.
+// In ascii mode, the size is sent first as 2 hex digits, so at most 255
+// bytes. Use CMD_WRNG for more. In binary mode, up to the device size.
 //
-void write_port(uint8_t data)
-{   
-    // Write the byte to port D
-     __delay_us(2);
-    LATD = data;
-
-    if (devType == DEV_2716) {
-        // Activate PD/PGM pulse for 50mS
-        __delay_us(2);
-        LATCbits.LATC2 = 1; 
-        __delay_ms(50);
+bool do_write()
+{
+    uint16_t len = bytes;
+    
+    if ((mode & MODE_BINARY) == 0) {
+        len = get_hex8();
+    }
+    return write_range(0, len);
+}
 
-        // Deactivate PGM pulse
-        LATCbits.LATC2 = 0;
-        __delay_us(2);
-    } 
-    else if (devType == DEV_2732) {
-        // Activate E_ pulse for 10mS
-        __delay_us(2);
-        LATCbits.LATC2 = 0; 
-        __delay_ms(10);
+// ****************************************************************************
+// write to a range of eprom. The start address and length are sent as
+// 4 hex digits each, so the host can write the whole device in one 
+// command, or patch just a region.
+//
+bool do_write_range()
+{
+    uint16_t start;
+    uint16_t len;
+    
+    if (!get_range(&start, &len)) {
+        return false;
+    }
+    return write_range(start, len);
+}
 
-        // Deactivate E_ pulse
-        LATCbits.LATC2 = 1;
-        __delay_us(2);   
+// ****************************************************************************
+// write to a range of eprom in blocks, double buffered. The host sends a
+// block of BLOCKSIZE bytes (less for the last), and we reply BLOCK_ACK as
+// soon as it is in RAM. While we program one block from RAM, the next one
+// is taken from the queue during the pulses into the other half of 
+// buffer, and ACKed as soon as it is complete, so the host can send the
+// one after. Args are as CMD_WRNG.
+//
+bool do_write_blocks()
+{
+    uint16_t  start;
+    uint16_t  len;
+    uint16_t  addr;
+    uint16_t  rxAddr;              // address of the block being received
+    uint16_t  progAddr = 0;        // address of the block being programmed
+    uint16_t  progLen  = 0;        // and its length, 0 if none
+    uint16_t  i;
+    uint8_t  *prog     = buffer;   // block being programmed
+    uint8_t  *fill     = buffer;   // block being received
+    rxblock_t rx;
+    bool      ok       = true;
+    
+    if (!get_block_range(&start, &len)) {
+        return false;
     }
-    else if (devType == DEV_2532) {
-        // Activate PGM_ pulse for 50mS
-        __delay_us(2);
-        LATCbits.LATC2 = 0; 
-        __delay_ms(50);
+    write_start();
+    
+    // Start receiving the first block
+    rxAddr    = start;
+    rx.status = RX_IDLE;
+    if (len > 0) {
+        rx_start(&rx, fill, len < BLOCKSIZE ? len : BLOCKSIZE, true);
+    }
+    
+    while (ok) {
+        if (progLen == 0) {
+            // Nothing to program, so wait for the block being received.
+            rx_wait(&rx);
+            if (rx.status == RX_BAD) {
+                uart_puts("bad frame");
+                ok = false;
+                break;
+            }
+            if (rx.status == RX_IDLE) {
+                // All done
+                break;
+            }
+            
+            // Program it, and receive the next one into the other half.
+            prog      = fill;
+            progAddr  = rxAddr;
+            progLen   = rx.need;
+            fill      = (fill == buffer) ? buffer + BLOCKSIZE : buffer;
+            rxAddr   += rx.need;
+            rx.status = RX_IDLE;
+            if (rxAddr < start + len) {
+                i = start + len - rxAddr;
+                rx_start(&rx, fill, i < BLOCKSIZE ? i : BLOCKSIZE, true);
+            }
+        }
+        
+        // Program the block. pgm_pulse() takes any chars for the next 
+        // one from the queue while each pulse runs.
+        rxPending = &rx;
+        for (i = 0; i < progLen; ++i) {
+            if (cmd_active == false) {
+                uart_puts("Write aborted\n");
+                ok = false;
+                break;
+            }
+            addr = progAddr + i;
+            ok = write_byte(addr, prog[i]);
+            if (!ok) {
+                break;
+            }
+        }
+        rxPending = 0;
+        trace_event(TR_BLOCK, progAddr + progLen);
+        progLen   = 0;
+    }
+    
+    return write_end(ok);
+}
 
-        // Deactivate PGM_ pulse
-        LATCbits.LATC2 = 1;
-        __delay_us(2);  
+// ****************************************************************************
+// Receive a CMD_WIND block of up to max bytes into buf: <num> <len>
+// <data 0..len-1> <crc hi> <crc lo>, the CRC16 being of num, len and the
+// data. The CRC goes in buf too, so it needs max + 2 bytes. The host
+// takes as long as it likes to start a block, but once started the rest
+// must follow within QUIET_MS, so a lost char can't hang us. True if it
+// is block num, with a good CRC.
+//
+bool wind_recv(uint8_t num, uint8_t *buf, uint8_t max, uint8_t *len)
+{
+    uint16_t crc = 0xffff;
+    uint8_t  n;
+    uint8_t  i;
+    char     c;
+    
+    c   = pop();
+    crc = crc16(crc, (uint8_t) c);
+    if (!pop_timed((char *) len, QUIET_MS)) {
+        return false;
+    }
+    crc = crc16(crc, *len);
+    if (*len == 0 || *len > max) {
+        return false;
     }
+    n = *len + 2;
+    for (i = 0; i < n; ++i) {
+        if (!pop_timed((char *) &buf[i], QUIET_MS)) {
+            return false;
+        }
+        crc = crc16(crc, buf[i]);
+    }
+    return crc == 0 && (uint8_t) c == num;
 }
 
 // ****************************************************************************
-// write to eprom
-// Timing critical code. At 20MHz xtal clock, each instruction = 200nS
+// write to a range of eprom in numbered blocks with a CRC, so a char lost
+// or corrupted on the link is sent again rather than programmed. Blocks
+// are binary whatever the mode, numbered from 0 and wrapping at 256, and
+// WINDSIZE bytes except for the last. We reply BLOCK_ACK and the block
+// number in 2 hex digits as soon as a block is in, before programming it,
+// so the host can keep WINDBLOCKS in flight and the link never waits on
+// a round trip. A bad block, or one out of order, is NAKed: BLOCK_NAK and
+// the number of the block we want. The host will have more on the way,
+// so we drop chars until the line is quiet before replying, and then
+// the host sends again from that block. Args are as CMD_WRNG.
 //
-void do_write()
+bool do_write_window()
 {
+    uint16_t start;
+    uint16_t len;
     uint16_t addr;
-    char c;
+    uint16_t end;
+    uint8_t  num   = 0;            // block we want next
+    uint8_t  tries = 0;            // times it has been NAKed
+    uint8_t  n;
+    uint8_t  i;
+    char     c;
+    bool     ok    = true;
     
-    // Set port D to output
-    TRISD = OUTPUT;
-      
-    // Set control bits for writing 
-    if (devType == DEV_2716) {
-        LATCbits.LATC0 = 1; // Set CS_ false (write)
-        LATCbits.LATC1 = 0; // set WE true (+25v vpp)
-        LATCbits.LATC2 = 0; // Set PD/PGM lo
-        //
-        // Wait for a couple of chars before starting
-        __delay_ms(200);
-    } 
-    else if (devType == DEV_2732 ) {
-        LATCbits.LATC0 = 1; // G_/VPP hi
-        LATCbits.LATC1 = 0; // set WE true (+21v vpp)
-        LATCbits.LATC2 = 1; // Set E_ false
-        //
-        // Wait for a couple of chars before starting
-        __delay_ms(200);
-    }
-    else if (devType == DEV_2532) {
-        LATCbits.LATC0 = 0; // not used
-        LATCbits.LATC1 = 0; // set WE true (+25v vpp)
-        LATCbits.LATC2 = 1; // Set PD/PGM_ hi
-        //
-        // Wait for a couple of chars before starting
-        __delay_ms(200);
-    }
-    
-    // Get the size of the data
-    c = pop();
-    uint8_t hi = charToHexDigit(c);
-    c = pop();
-    uint8_t lo = charToHexDigit(c);
-    uint16_t size = hi*16+lo;
-    
-    for (addr = 0; addr < size; addr++) {
+    if (!get_block_range(&start, &len)) {
+        return false;
+    }
+    write_start();
+    
+    end = start + len;
+    for (addr = start; ok && addr < end; ) {
         if (cmd_active == false) {
             uart_puts("Write aborted\n");
-            return;
+            ok = false;
+            break;
+        }
+        if (!wind_recv(num, buffer, end - addr < WINDSIZE ? end - addr
+                                                          : WINDSIZE, &n)) {
+            if (cmd_active == false) {
+                continue;
+            }
+            while (pop_timed(&c, QUIET_MS)) {
+                // drop what was in flight
+            }
+            stats.naks++;
+            trace_event(TR_NAK, num);
+            if (++tries > WINDTRIES) {
+                uart_puts("bad link");
+                ok = false;
+                break;
+            }
+            uart_putc(BLOCK_NAK);
+            put_hex8(num);
+            continue;
+        }
+        uart_putc(BLOCK_ACK);
+        put_hex8(num);
+        num++;
+        tries = 0;
+        
+        for (i = 0; i < n && ok; ++i) {
+            ok = write_byte(addr++, buffer[i]);
         }
+        trace_event(TR_BLOCK, addr);
+    }
+    
+    return write_end(ok);
+}
 
-        // Get two ascii chars from queue and convert to 8 bit data.
-        c = pop();
-        uint8_t hi = charToHexDigit(c);
-        c = pop();
-        uint8_t lo = charToHexDigit(c);
-        uint8_t data = hi*16+lo;
+// ****************************************************************************
+// Report a bad Intel HEX record.
+//
+void hex_fail(uint16_t addr)
+{
+    uart_puts("Bad record at address 0x");
+    put_hex16(addr);
+    uart_putc('\n');
+}
 
-        // Latch the 16 bit address.
-        setup_address(addr);
+// ****************************************************************************
+// Program Intel HEX records as they arrive, until an EOF record. Each
+// record ":LLAAAATT<data>CC" is received into buffer and its checksum
+// checked before any of it is programmed, then the data goes to the
+// record's address. So a sparse image only sends and programs what it
+// has, and a garbled line stops the write at that record. Anything 
+// between records, such as CR LF, is ignored. Records are always ascii,
+// whatever the mode. For the 2708 the records are collected in buffer
+// and programmed in passes at the EOF.
+//
+bool do_write_hex()
+{
+    uint8_t  n;                    // data bytes in the record
+    uint16_t addr;
+    uint8_t  type;
+    uint8_t  sum;
+    uint8_t  i;
+    uint8_t *data;
+    uint16_t lo      = 0xffff;     // range received, for passes
+    uint16_t hi      = 0;
+    bool     passes  = dev->passes > 1;
+    bool     ok      = true;
     
-        // Write the byte to port D
-        write_port(data);
+    if (passes) {
+        for (addr = 0; addr < dev->size; ++addr) {
+            buffer[addr] = 0xff;
+        }
     }
     
-    // Set outputs disabled
-    if (devType == DEV_2716) {
-        LATCbits.LATC0 = 1; // Set CS_ true
-        LATCbits.LATC1 = 1; // set WE_ false (+5v vpp)
-        LATCbits.LATC2 = 0; // Set PD/PGM lo
-    } 
-    else if (devType == DEV_2732) {
-        LATCbits.LATC0 = 1; // Set G_/VPP hi
-        LATCbits.LATC1 = 1; // set WE_ false (+5v vpp)
-        LATCbits.LATC2 = 1; // Set E_ false
+    // No wait for data, records are parsed from the queue as they come.
+    write_start();
+    
+    while (true) {
+        if (cmd_active == false) {
+            uart_puts("Write aborted\n");
+            ok = false;
+            break;
+        }
+        if (pop() != ':') {
+            continue;
+        }
+        n    = get_hex8();
+        addr = get_hex16();
+        type = get_hex8();
+        sum  = (uint8_t) (n + (addr >> 8) + (addr & 0xff) + type);
+        
+        // Data goes to buffer, or where it will be programmed from for
+        // passes. The other records are short, and go to frame.
+        if (type == HEX_DATA) {
+            if (addr > bytes || n > bytes - addr) {
+                uart_puts("bad range");
+                ok = false;
+                break;
+            }
+            data = passes ? buffer + addr : buffer;
+        }
+        else if (n <= READFRAME) {
+            data = frame;
+        }
+        else {
+            hex_fail(addr);
+            ok = false;
+            break;
+        }
+        for (i = 0; i < n; ++i) {
+            data[i] = get_hex8();
+            sum += data[i];
+        }
+        sum += get_hex8();
+        if (sum != 0) {
+            hex_fail(addr);
+            ok = false;
+            break;
+        }
+        
+        if (type == HEX_EOF) {
+            break;
+        }
+        else if (type == HEX_DATA) {
+            if (passes) {
+                if (addr < lo) {
+                    lo = addr;
+                }
+                if (addr + n > hi) {
+                    hi = addr + n;
+                }
+                continue;
+            }
+            for (i = 0; i < n && ok; ++i) {
+                ok = write_byte(addr + i, data[i]);
+            }
+            if (!ok) {
+                break;
+            }
+            trace_event(TR_BLOCK, addr + n);
+        }
+        else if (type == HEX_ESEG || type == HEX_ELIN) {
+            if (n != 2 || data[0] != 0 || data[1] != 0) {
+                uart_puts("bad range");
+                ok = false;
+                break;
+            }
+        }
+        else if (type != HEX_SSEG && type != HEX_SLIN) {
+            hex_fail(addr);
+            ok = false;
+            break;
+        }
     }
-    else if (devType == DEV_2532) {
-        LATCbits.LATC0 = 0; // not used
-        LATCbits.LATC1 = 1; // set WE_ false (+5v vpp)
-        LATCbits.LATC2 = 0; // Set PD/PGM_ lo
+    
+    // The 0xFF between records is already erased, so don't pulse it
+    if (ok && passes && lo < hi) {
+        ok = run_passes(buffer + lo, lo, hi - lo, true);
     }
     
-    // Set port D to input
-    TRISD = INPUT;
+    return write_end(ok);
+}
+
+// ****************************************************************************
+// Reply with the stats in hex, as "rrrrrrrr ssssssss cccc dddd ffff oooo
+// wwwwwwww pppppppp\n": chars received and sent, CTS stops, chars dropped,
+// framing errors, overrun errors, mS waiting for chars and mS of program
+// pulses. Then clear them if the next char is '1'. The isr changes some,
+// and they are more than 8 bits, so copy them with it off.
+//
+bool do_stats()
+{
+    bool     reset = pop() == '1';
+    stats_t  s;
+    uint32_t sent;
     
-    uart_puts("OK");
+    INTCONbits.GIE = 0;
+    s    = stats;
+    sent = uart_get_sent();
+    if (reset) {
+        stats.received  = 0;
+        stats.ctsStops  = 0;
+        stats.dropped   = 0;
+        stats.ferr      = 0;
+        stats.oerr      = 0;
+        stats.starvedMs = 0;
+        stats.pulseMs   = 0;
+        stats.naks      = 0;
+        uart_clear_sent();
+    }
+    INTCONbits.GIE = 1;
+    
+    put_hex32(s.received);
+    uart_putc(' ');
+    put_hex32(sent);
+    uart_putc(' ');
+    put_hex16(s.ctsStops);
+    uart_putc(' ');
+    put_hex16(s.dropped);
+    uart_putc(' ');
+    put_hex16(s.ferr);
+    uart_putc(' ');
+    put_hex16(s.oerr);
+    uart_putc(' ');
+    put_hex32(s.starvedMs);
+    uart_putc(' ');
+    put_hex32(s.pulseMs);
+    uart_putc(' ');
+    put_hex16(s.naks);
+    uart_putc('\n');
+    return true;
+}
+
+// ****************************************************************************
+// Reply with the trace, oldest first, a line "mmmm ss cc aaaa\n" for each
+// event: the mS tick, Timer0 counts of 6.4uS into it, the TR_ code and
+// its arg, then an empty line. Then clear it if the next char is '1'.
+//
+bool do_trace()
+{
+    bool    reset = pop() == '1';
+    uint8_t n     = traceCount;
+    uint8_t i     = (traceNext - n) & TRACEMASK;
+    trace_t t;
+    
+    while (n--) {
+        INTCONbits.GIE = 0;
+        t = trace[i];
+        INTCONbits.GIE = 1;
+        put_hex16(t.ms);
+        uart_putc(' ');
+        put_hex8(t.sub);
+        uart_putc(' ');
+        put_hex8(t.code);
+        uart_putc(' ');
+        put_hex16(t.arg);
+        uart_putc('\n');
+        i = (i + 1) & TRACEMASK;
+    }
+    uart_putc('\n');
+    
+    if (reset) {
+        INTCONbits.GIE = 0;
+        traceCount = 0;
+        INTCONbits.GIE = 1;
+    }
+    return true;
+}
+
+// ****************************************************************************
+// Do a cmd. False if it failed, so the cmds queued after it are dropped.
+//
+bool run_cmd(char cmd)
+{
+    // Do the cmd
+    if      (cmd == CMD_READ) {
+        return do_read();
+    }
+    else if (cmd == CMD_WRTE) {
+        return do_write();
+    }
+    else if (cmd == CMD_WRNG) {
+        return do_write_range();
+    }
+    else if (cmd == CMD_BLCK) {
+        return do_write_blocks();
+    }
+    else if (cmd == CMD_WIND) {
+        return do_write_window();
+    }
+    else if (cmd == CMD_HEX) {
+        return do_write_hex();
+    }
+    else if (cmd == CMD_CHEK) {
+        return do_blank();
+    }
+    else if (cmd == CMD_PMAP) {
+        return do_blank_map();
+    }
+    else if (cmd == CMD_CRC) {
+        return do_crc();
+    }
+    else if (cmd == CMD_VRFY) {
+        return do_verify_pages();
+    }
+    else if (cmd == CMD_PACK) {
+        return do_read_packed();
+    }
+    else if (cmd == CMD_INIT) {
+        uart_puts("Already init");
+        return true;
+    }
+    else if (cmd == CMD_TYPE) {
+        return do_type();
+    }
+    else if (cmd == CMD_MODE) {
+        return do_mode();
+    }
+    else if (cmd == CMD_BAUD) {
+        return do_baud();
+    }
+    else if (cmd == CMD_GANG) {
+        return do_gang();
+    }
+    else if (cmd == CMD_STAT) {
+        return do_stats();
+    }
+    else if (cmd == CMD_TRCE) {
+        return do_trace();
+    }
+    else if (cmd == CMD_IDEN) {
+        uart_puts((char *) dev->name);
+        return true;
+    }
+    else if (cmd == CMD_RSET) {
+        uart_flush();
+        asm("RESET");
+    }
+    return false;
 }
 
 // ****************************************************************************
@@ -641,73 +2753,86 @@ void main(void) {
     // Initialise the IO ports
     ports_init();
     
-    // Wait for a 'U' char to init the uart BRG
-    do_init();
+    // Start the mS tick, which also flashes the LEDs
+    timer_init();
+    
+    // Start at the saved rate and type if we have them. Else, or if the
+    // host turns out to be at another rate, wait for a 'U' char to init
+    // the uart BRG.
+    uint16_t brg;
+    uint8_t  type;
+    if (config_load(&brg, &type) && set_type(type)) {
+        uart_set_brg(brg);
+        linkStored = true;
+    }
+    else {
+        ledMode = LED_INIT;
+        do_init();
+    }
     
     // Enable interrupts
     PIE1bits.RCIE=1;
     INTCONbits.GIE = 1;
         
-    // Loop while waiting for commands
-    // We flash a green LED so we know we are listening...
+    // Loop while waiting for commands. The LEDs are driven from the tick,
+    // so nothing here waits, and a cmd starts as soon as it arrives.
     while (true) { 
         if (cmd_active) {
             // Turn on orange LED to show we're active
-            PORTCbits.RC3 = 0; // green off
-            PORTCbits.RC4 = 1; // orange on
+            ledMode = LED_BUSY;
             
             // pop the $
             pop();
             // and the cmd
-            char cmd = pop();
-            
-            // Do the cmd
-            if      (cmd == CMD_READ) {
-                do_read();
-            }
-            else if (cmd == CMD_WRTE) {
-                do_write();
+            char cmd    = pop();
+            bool tagged = (mode & MODE_TAGGED) != 0;
+            if (tagged) {
+                uart_putc('{');
+                uart_putc(cmd);
             }
-            else if (cmd == CMD_CHEK) {
-                do_blank();
-            }
-            else if (cmd == CMD_INIT) {
-                uart_puts("Already init");
+            trace_event(TR_CMD, cmd);
+            traceFirst = true;
+            bool ok = run_cmd(cmd);
+            traceFirst = false;
+            trace_event(TR_DONE, cmd);
+            
+            // The host may have queued the next cmds already. If this one
+            // failed, they are dropped, along with the rest of this one's
+            // data, until the line goes quiet. A tagged failure reply is
+            // only closed after that, so the host knows when to go on.
+            if (aborted) {
+                abort_end(cmd);
+                ok = false;
             }
-            else if (cmd == CMD_TYPE) {
-                do_type();
+            else if (!ok) {
+                wait_quiet();
             }
-            else if (cmd == CMD_IDEN) {
-                if      (devType == DEV_2716) {
-                    uart_puts("2716");
-                } 
-                else if (devType == DEV_2732) {
-                    uart_puts("2732");
-                }
-                else if (devType == DEV_2532) {
-                    uart_puts("2532");
-                }
-                else {
-                    uart_puts("ERROR");
-                }
+            if (tagged) {
+                uart_puts(ok ? "}\n" : "}!\n");
             }
-            else if (cmd == CMD_RSET) {
-                asm("RESET");
+            if (ok) {
+                next_cmd();
             }
-            
-            // Clear the cmd
-            clear();
         } 
+        else if (aborted) {
+            // Between cmds, or before a queued one started
+            abort_end(0);
+        }
+        else if (linkReq == LINK_AUTO) {
+            linkReq = LINK_NONE;
+            do_reinit();
+        }
+        else if (linkReq == LINK_REPLY) {
+            // Already at the host's rate, reply as do_init() would
+            linkReq = LINK_NONE;
+            put_dec(uart_get_brg());
+            uart_putc('\n');
+        }
         else {
-            // Green LED on to show we're ready
-            PORTCbits.RC3 = 1; // green on
-            PORTCbits.RC4 = 0; // orange off
+            // Green LED on to show we're ready. The NOP is where the
+            // host sim (sim/) lets time pass while we wait.
+            ledMode = LED_IDLE;
+            NOP();
         }
-        
-        // Delay for the loop
-        __delay_us(10);      
     } 
 }
-
-
-
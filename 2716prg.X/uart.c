@@ -16,6 +16,48 @@
 #include <stdarg.h>
 #include <string.h>
 
+// Chars to send are put in a ring buffer, drained by the TX interrupt.
+#define TXSIZE 64                  // Must be a power of 2
+#define TXMASK (TXSIZE-1)
+
+static volatile char    txbuf[TXSIZE];
+static volatile uint8_t txhead = 0; // next char to send, moved by isr
+static volatile uint8_t txtail = 0; // next free slot, moved by uart_putc
+static uint32_t sent = 0;           // chars sent, for the stats
+
+// Baud rates for uart_set_baud(). With BRG16 and BRGH set,
+// baud = Fosc / (4 * (SPBRG + 1)), so SPBRG is rounded to the nearest.
+// BRG_CHECK fails the build if the rate is more than 2% out, e.g. 921600
+// at 20MHz is 8.5% out, so use 1000000 (exact) instead.
+#define BRG_VALUE(b)  ((_XTAL_FREQ + 2*(b)) / (4*(b)) - 1)
+#define BRG_ACTUAL(b) (_XTAL_FREQ / (4*(BRG_VALUE(b) + 1)))
+#define BRG_DIFF(b)   (BRG_ACTUAL(b) > (b) ? BRG_ACTUAL(b) - (b) : (b) - BRG_ACTUAL(b))
+#define BRG_CHECK(b)  typedef char brg_check_##b[(BRG_DIFF(b##UL) * 50 <= (b##UL)) ? 1 : -1]
+
+BRG_CHECK(9600);
+BRG_CHECK(19200);
+BRG_CHECK(38400);
+BRG_CHECK(57600);
+BRG_CHECK(115200);
+BRG_CHECK(230400);
+BRG_CHECK(250000);
+BRG_CHECK(460800);
+BRG_CHECK(500000);
+BRG_CHECK(1000000);
+
+static const uint16_t brgTable[NBAUDS] = {
+    BRG_VALUE(9600UL),      // 0
+    BRG_VALUE(19200UL),     // 1
+    BRG_VALUE(38400UL),     // 2
+    BRG_VALUE(57600UL),     // 3
+    BRG_VALUE(115200UL),    // 4
+    BRG_VALUE(230400UL),    // 5
+    BRG_VALUE(250000UL),    // 6, exact
+    BRG_VALUE(460800UL),    // 7
+    BRG_VALUE(500000UL),    // 8, exact
+    BRG_VALUE(1000000UL)    // 9, exact
+};
+
 // ****************************************************************************
 // Function         [ uart_init ]
 // Description      [ ]
@@ -45,7 +87,7 @@ void uart_init(const uint32_t baud_rate)
     // If baud_rate is 0, use auto baud detection
     if (baud_rate != 0) {
         // Get the constant for baud rate calculation
-        uint8_t factor;
+        uint8_t factor = 4;
         if (BAUDCONbits.BRG16 && TXSTAbits.BRGH)
             factor = 4;
         else if (BAUDCONbits.BRG16 && !TXSTAbits.BRGH)
@@ -95,15 +137,11 @@ uint16_t uart_init_brg()
         
         // reading RCREG clears RCIF
         if (PIR1bits.RCIF) {
-            char c = RCREG & 0x7f; 
+            (void) RCREG;
             break;
         }
         
-        // Flash orange LED while waiting...
-        PORTCbits.RC4 = 1;
-        __delay_ms(250);
-        PORTCbits.RC4 = 0;
-        __delay_ms(250);
+        // The caller flashes a LED from the timer while we wait.
         
         if ( BAUDCONbits.ABDOVF ) {
             BAUDCONbits.ABDOVF = 0;
@@ -113,59 +151,117 @@ uint16_t uart_init_brg()
     // Return the baudrate from SPBRG
     rate = (SPBRGH << 8) | SPBRG;
     
-    // Orange LED off
-    PORTCbits.RC4 = 0;
-    
     // enable interrupts
     PIE1bits.RCIE=1;
       
     return rate;
 }
 
+// ****************************************************************************
+// Function         [ uart_get_brg ]
+// Description      [ Get the current baud rate generator value ]
+// ****************************************************************************
+uint16_t uart_get_brg()
+{
+    return (SPBRGH << 8) | SPBRG;
+}
+
+// ****************************************************************************
+// Function         [ uart_set_brg ]
+// Description      [ Set the baud rate generator. Flush first so we don't
+//                    change rate in the middle of a char. ]
+// ****************************************************************************
+void uart_set_brg(uint16_t brg)
+{
+    uart_flush();
+    SPBRGH = brg >> 8;
+    SPBRG  = brg & 0xff;
+}
+
+// ****************************************************************************
+// Function         [ uart_set_baud ]
+// Description      [ Set baud rate i from the table. Returns false if
+//                    there is no such rate. ]
+// ****************************************************************************
+bool uart_set_baud(uint8_t i)
+{
+    if (i >= NBAUDS) {
+        return false;
+    }
+    uart_set_brg(brgTable[i]);
+    return true;
+}
+
 // ****************************************************************************
 // Function         [ uart_getc ]
-// Description      [ Receive a char in c. Returns true if OK ]
+// Description      [ Receive a char in c. Returns UART_OK, or UART_NONE
+//                    if there isn't one, or the error. ]
 // ****************************************************************************
-bool uart_getc(char *c)
+uint8_t uart_getc(char *c)
 {  
-    // NULL if we had an error
-    bool ok = false;
+    uint8_t status = UART_NONE;
     
     // Check for errors
     if (RCSTAbits.FERR) {
-        uint8_t er = RCREG;    // Framing error
+        *c = RCREG;            // Framing error, reading clears it
+        status = UART_FERR;
     }
     else if (RCSTAbits.OERR) {
         RCSTAbits.CREN = 0;    // Overrun error, clear it
         RCSTAbits.CREN = 1;    // by toggling CREN
+        status = UART_OERR;
     }
     else {
         if (PIR1bits.RCIF) {
-            *c = RCREG & 0x7f; // strip hi bit
-            ok = true;
+            *c = RCREG;        // all 8 bits, for binary transfers
+            status = UART_OK;
         }
     } 
-    return ok;
+    return status;
+}
+
+// ****************************************************************************
+// Function         [ uart_tx_isr ]
+// Description      [ Send the next char from the TX buffer. Called by the
+//                    interrupt when TXREG is empty. ]
+// ****************************************************************************
+void uart_tx_isr()
+{
+    if (PIE1bits.TXIE && PIR1bits.TXIF) {
+        if (txhead != txtail) {
+            TXREG  = txbuf[txhead];
+            txhead = (txhead + 1) & TXMASK;
+        }
+        if (txhead == txtail) {
+            // Nothing more to send
+            PIE1bits.TXIE = 0;
+        }
+    }
 }
 
 // ****************************************************************************
 // Function         [ uart_putc ]
-// Description      [ Send a character ]
+// Description      [ Queue a character to send ]
 // ****************************************************************************
 void uart_putc(char c)
 {
-    // Wait until TXREG ready
-    while (PIR1bits.TXIF == 0) {
-        NOP();
-    }
+    uint8_t next = (txtail + 1) & TXMASK;
     
-    // Put the char to send in transmit buffer
-    TXREG = c;
-
-    // Wait for done
-    while(TXSTAbits.TRMT == 0) {
-        NOP();
+    // Wait while the buffer is full. If interrupts are off, 
+    // send from here instead.
+    while (next == txhead) {
+        if (INTCONbits.GIE == 0) {
+            PIE1bits.TXIE = 1;
+            uart_tx_isr();
+        }
     }
+    
+    txbuf[txtail] = c;
+    txtail = next;
+    sent++;
+    
+    // TXIF is set whenever TXREG is empty, so this starts sending.
+    PIE1bits.TXIE = 1;
 }
 
 // ****************************************************************************
@@ -174,18 +270,41 @@ void uart_putc(char c)
 // ****************************************************************************
 void uart_puts(char *s)
 {
-    // Wait until TXREG ready
-    while (PIR1bits.TXIF == 0) {
-        NOP();
+    while (*s) {
+        uart_putc(*s++);
     }
+}
 
-    // Put the char to send in transmit buffer
-    char *p = s;
-    while (*p) {
-        TXREG = *p++;
-        while(TXSTAbits.TRMT == 0) {
-            NOP();
+// ****************************************************************************
+// Function         [ uart_flush ]
+// Description      [ Wait until all queued chars have been sent ]
+// ****************************************************************************
+void uart_flush()
+{
+    while (txhead != txtail) {
+        if (INTCONbits.GIE == 0) {
+            uart_tx_isr();
         }
     }
+    while (TXSTAbits.TRMT == 0) {
+        NOP();
+    }
 }
 
+// ****************************************************************************
+// Function         [ uart_get_sent ]
+// Description      [ Get the count of chars sent ]
+// ****************************************************************************
+uint32_t uart_get_sent()
+{
+    return sent;
+}
+
+// ****************************************************************************
+// Function         [ uart_clear_sent ]
+// Description      [ Clear the count of chars sent ]
+// ****************************************************************************
+void uart_clear_sent()
+{
+    sent = 0;
+}
@@ -22,20 +22,46 @@
 extern "C" {
 #endif
     
+// Number of baud rates in the table for uart_set_baud()
+#define NBAUDS 10
+    
 // Initialise the UART
 void uart_init(const uint32_t baud_rate);
 
 // set up the baud rate
 uint16_t uart_init_brg();
 
+// Get and set the baud rate generator
+uint16_t uart_get_brg();
+void uart_set_brg(uint16_t brg);
+
+// Set baud rate i from the table, 0 = 9600 ... 9 = 1000000
+bool uart_set_baud(uint8_t i);
+
 // Send a char from the UART
 void uart_putc(char c);
 
 // Send a string from the UART
 void uart_puts(char *s);
 
-// receive a char from the UART
-bool  uart_getc(char *c);
+// Send the next queued char, called by the interrupt
+void uart_tx_isr();
+
+// Wait until all queued chars have been sent
+void uart_flush();
+
+// uart_getc() results
+#define UART_NONE 0                // no char
+#define UART_OK   1                // a char in c
+#define UART_FERR 2                // framing error, the junk char in c
+#define UART_OERR 3                // overrun, chars lost
+
+// receive a char from the UART, returns UART_OK etc
+uint8_t uart_getc(char *c);
+
+// Count of chars sent, and clear it
+uint32_t uart_get_sent();
+void uart_clear_sent();
 
 #ifdef	__cplusplus
 }
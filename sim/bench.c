@@ -0,0 +1,794 @@
+// ****************************************************************************
+//
+// File                 : bench.c
+// Description          : Benchmarks of the programmer protocol, run by
+//                        sim --bench against the real firmware in virtual
+//                        time. Each cmd is timed from its first char sent
+//                        to the last char of its reply, at several baud
+//                        rates and transfer modes, and its result checked,
+//                        so a change to the protocol or the firmware can
+//                        be measured without burning chips.
+//
+//                        The runs are deterministic, so two builds can be
+//                        compared line by line.
+//
+// ****************************************************************************
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include <string.h>
+
+#include "sim.h"
+
+#define DEVSIZE    2048            // a 2716, the firmware's default
+#define PAGESIZE   256             // as CMD_VRFY
+#define QUIET_MS   20              // a reply is over after this long quiet
+#define TIMEOUT_MS 600000          // longest a write can take
+#define REPLYSIZE  (DEVSIZE * 4)   // an ascii read, with room
+#define WINDSIZE   64              // CMD_WIND block, as the firmware
+#define WINDBLOCKS 3               // and how many may be unACKed
+#define ACK_MS     5000            // no ACK this long, send again
+#define ERR_EVERY  700             // chars per framing error, when on
+
+// Transfer modes, as the firmware's MODE_ bits
+#define MODE_BINARY 0x01
+#define MODE_FAST   0x02
+#define MODE_SKIPFF 0x04
+
+// Baud rates the firmware has, by CMD_BAUD index
+static const uint32_t bauds[] = {
+    9600, 19200, 38400, 57600, 115200, 230400, 250000, 460800, 500000,
+    1000000
+};
+#define NBAUDS (sizeof(bauds) / sizeof(bauds[0]))
+
+// The rates and modes benchmarked
+static const uint32_t benchBauds[] = { 115200, 460800, 1000000 };
+#define NBENCH (sizeof(benchBauds) / sizeof(benchBauds[0]))
+
+static uint8_t  image[DEVSIZE];    // what is written, or is in the socket
+static char     reply[REPLYSIZE];
+static uint8_t  data[DEVSIZE * 4]; // cmd data to send
+static uint32_t linkBaud;          // rate the link is at, 0 before init
+static bool     allOk = true;
+
+// ****************************************************************************
+// The same image each run: code-like bytes in the first half of each
+// 512 bytes, erased in the second, as a part filled EPROM would be.
+//
+static void make_image(void)
+{
+    uint32_t x = 12345;
+    unsigned i;
+
+    for (i = 0; i < DEVSIZE; ++i) {
+        x = x * 1103515245u + 12345u;
+        image[i] = (i & 0x100) ? 0xff : (uint8_t) (x >> 16);
+    }
+}
+
+// ****************************************************************************
+// The socket: erased, or holding the image
+//
+static void rom_erase(void)
+{
+    int s;
+
+    for (s = 0; s < SIM_SOCKETS; ++s) {
+        memset(sim_rom[s].cell, 0xff, sizeof(sim_rom[s].cell));
+        memset(sim_rom[s].pulseNs, 0, sizeof(sim_rom[s].pulseNs));
+    }
+}
+
+static void rom_load(void)
+{
+    rom_erase();
+    memcpy(sim_rom[0].cell, image, DEVSIZE);
+}
+
+static bool rom_is_image(void)
+{
+    return memcmp(sim_rom[0].cell, image, DEVSIZE) == 0;
+}
+
+static bool socket_is_image(int s)
+{
+    return memcmp(sim_rom[s].cell, image, DEVSIZE) == 0;
+}
+
+// ****************************************************************************
+// The firmware's CRC16, as CMD_CRC
+//
+static uint16_t crc16(const uint8_t *p, unsigned n)
+{
+    uint16_t crc = 0xffff;
+    int      b;
+
+    while (n--) {
+        crc ^= (uint16_t) (*p++ << 8);
+        for (b = 0; b < 8; ++b) {
+            crc = (crc & 0x8000) ? (uint16_t) ((crc << 1) ^ 0x1021)
+                                 : (uint16_t) (crc << 1);
+        }
+    }
+    return crc;
+}
+
+// ****************************************************************************
+// Send a cmd and wait for a reply of n chars, or for up to max chars
+// followed by QUIET_MS of quiet if n is 0. Returns the chars received,
+// null terminated in reply, and the time taken in *ms.
+//
+static unsigned cmd(const char *c, const void *d, unsigned dn, unsigned n,
+                    double *ms)
+{
+    uint64_t t0 = sim_now_ns();
+    unsigned got;
+
+    host_puts(c);
+    host_send(d, dn);
+    if (n > 0) {
+        got = host_recv(reply, n, TIMEOUT_MS);
+    }
+    else {
+        got = host_recv_quiet(reply, REPLYSIZE - 1, QUIET_MS);
+    }
+    reply[got] = 0;
+    if (ms) {
+        *ms = got ? (host_last_rx_ns() - t0) / 1e6 : 0;
+    }
+    return got;
+}
+
+static bool cmd_ok(const char *c)
+{
+    return cmd(c, 0, 0, 2, 0) == 2 && strcmp(reply, "OK") == 0;
+}
+
+// ****************************************************************************
+// Get the link up at baud, by auto baud the first time, then CMD_BAUD
+//
+static bool link_at(uint32_t baud)
+{
+    char     c[4];
+    unsigned i;
+
+    if (linkBaud == 0) {
+        // The reply is the BRG value, then a newline
+        char ch = 0;
+        host_start(115200);
+        host_idle(10);
+        host_puts("U");
+        while (ch != '\n') {
+            if (host_recv(&ch, 1, 1000) != 1) {
+                return false;
+            }
+        }
+        linkBaud = 115200;
+    }
+    if (baud == linkBaud) {
+        return true;
+    }
+    for (i = 0; i < NBAUDS && bauds[i] != baud; ++i) {
+    }
+    snprintf(c, sizeof(c), "$B%x", i);
+    if (i == NBAUDS || !cmd_ok(c)) {
+        return false;
+    }
+    host_set_baud(baud);
+    linkBaud = baud;
+    return cmd_ok("U");
+}
+
+static bool set_mode(uint8_t m)
+{
+    char c[8];
+
+    snprintf(c, sizeof(c), "$6%02x", m);
+    return cmd_ok(c);
+}
+
+// ****************************************************************************
+// One line of results
+//
+static void result(const char *what, uint8_t m, double ms, unsigned chars,
+                   bool ok)
+{
+    printf("%-8s %7u  %-12s %10.1f ms %8u chars  %s\n", what, linkBaud,
+           (m & MODE_BINARY) ? ((m & MODE_FAST) ? "binary fast" : "binary")
+                             : ((m & MODE_FAST) ? "ascii fast"  : "ascii"),
+           ms, chars, ok ? "ok" : "WRONG");
+    if (!ok) {
+        allOk = false;
+        printf("         reply: %.60s\n", reply);
+    }
+}
+
+// ****************************************************************************
+// Collect the data of the binary frames in reply, up to the empty one,
+// into out. Returns the bytes, or -1 if a frame is bad or too big, or the
+// empty frame is missing.
+//
+static int unframe(unsigned n, uint8_t *out, unsigned max)
+{
+    unsigned len = 0;
+    unsigned i   = 0;
+
+    while (i < n) {
+        unsigned f   = (uint8_t) reply[i];
+        uint8_t  sum = 0;
+        unsigned j;
+        if (f == 0) {
+            return (int) len;
+        }
+        if (i + f + 2 > n || len + f > max) {
+            return -1;
+        }
+        for (j = 0; j < f + 2; ++j) {
+            sum += (uint8_t) reply[i + j];
+        }
+        if (sum != 0) {
+            return -1;
+        }
+        memcpy(out + len, reply + i + 1, f);
+        len += f;
+        i   += f + 2;
+    }
+    return -1;
+}
+
+// ****************************************************************************
+// Check a read reply against the image: binary frames to an empty one,
+// or "aaaa: dd dd ..." lines.
+//
+static bool read_matches(unsigned n, bool binary)
+{
+    uint8_t  got[DEVSIZE];
+    unsigned len = 0;
+
+    if (binary) {
+        int f = unframe(n, got, DEVSIZE);
+        if (f < 0) {
+            return false;
+        }
+        len = (unsigned) f;
+    }
+    else {
+        char *p = reply;
+        while (*p && len < DEVSIZE) {
+            unsigned a, b;
+            int      k;
+            if (sscanf(p, "%4x:%n", &a, &k) != 1 || a != len) {
+                return false;
+            }
+            p += k;
+            while (p[0] == ' ' && isxdigit((unsigned char) p[1]) &&
+                   sscanf(p, " %2x%n", &b, &k) == 1) {
+                got[len++] = (uint8_t) b;
+                p += k;
+                if (len == DEVSIZE) {
+                    break;
+                }
+            }
+            while (*p == ' ' || *p == '\n' || *p == '\r') {
+                ++p;
+            }
+        }
+    }
+    return len == DEVSIZE && memcmp(got, image, DEVSIZE) == 0;
+}
+
+// ****************************************************************************
+// Check a CMD_PACK reply against the image. The packed bytes come in
+// binary frames, or in lines of hex digits to an empty line, and unpack
+// as do_read_packed() says: c < 0x80 then c+1 literals, or c >= 0x80
+// then one byte repeated c-0x7e times.
+//
+static bool packed_matches(unsigned n, bool binary)
+{
+    static uint8_t packed[REPLYSIZE];
+    uint8_t  got[DEVSIZE];
+    unsigned pn  = 0;
+    unsigned len = 0;
+    unsigned i;
+
+    if (binary) {
+        int f = unframe(n, packed, sizeof(packed));
+        if (f < 0) {
+            return false;
+        }
+        pn = (unsigned) f;
+    }
+    else {
+        char *p = reply;
+        while (*p != '\n') {
+            unsigned b;
+            while (isxdigit((unsigned char) p[0]) &&
+                   isxdigit((unsigned char) p[1]) &&
+                   sscanf(p, "%2x", &b) == 1) {
+                packed[pn++] = (uint8_t) b;
+                p += 2;
+            }
+            if (*p != '\n') {
+                return false;
+            }
+            ++p;
+        }
+    }
+
+    i = 0;
+    while (i < pn) {
+        unsigned c = packed[i++];
+        if (c < 0x80) {
+            if (i + c + 1 > pn || len + c + 1 > DEVSIZE) {
+                return false;
+            }
+            memcpy(got + len, packed + i, c + 1);
+            len += c + 1;
+            i   += c + 1;
+        }
+        else {
+            if (i >= pn || len + c - 0x7e > DEVSIZE) {
+                return false;
+            }
+            memset(got + len, packed[i++], c - 0x7e);
+            len += c - 0x7e;
+        }
+    }
+    return len == DEVSIZE && memcmp(got, image, DEVSIZE) == 0;
+}
+
+// ****************************************************************************
+// Encode the image as cmd data: ascii hex, or binary frames of n bytes
+// then an empty frame.
+//
+static unsigned encode_hex(const uint8_t *p, unsigned n)
+{
+    static const char hex[] = "0123456789abcdef";
+    unsigned i;
+
+    for (i = 0; i < n; ++i) {
+        data[2*i]     = (uint8_t) hex[p[i] >> 4];
+        data[2*i + 1] = (uint8_t) hex[p[i] & 15];
+    }
+    return 2 * n;
+}
+
+static unsigned encode_frames(const uint8_t *p, unsigned n, unsigned size)
+{
+    unsigned len = 0;
+    unsigned i;
+    unsigned j;
+
+    for (i = 0; i <= n; i += size) {
+        unsigned f   = n - i < size ? n - i : size;
+        uint8_t  sum = (uint8_t) f;
+        data[len++] = (uint8_t) f;
+        for (j = 0; j < f; ++j) {
+            data[len++] = p[i + j];
+            sum += p[i + j];
+        }
+        data[len++] = (uint8_t) -sum;
+        if (f == 0) {
+            break;
+        }
+    }
+    return len;
+}
+
+// Intel HEX records of 16 bytes, skipping those that are all 0xFF
+static unsigned encode_ihex(const uint8_t *p, unsigned n)
+{
+    unsigned len = 0;
+    unsigned a;
+    unsigned i;
+
+    for (a = 0; a < n; a += 16) {
+        uint8_t sum = (uint8_t) (16 + (a >> 8) + (a & 0xff));
+        bool    ff  = true;
+        for (i = 0; i < 16; ++i) {
+            ff = ff && p[a + i] == 0xff;
+        }
+        if (ff) {
+            continue;
+        }
+        len += (unsigned) sprintf((char *) data + len, ":10%04X00", a);
+        for (i = 0; i < 16; ++i) {
+            len += (unsigned) sprintf((char *) data + len, "%02X", p[a + i]);
+            sum += p[a + i];
+        }
+        len += (unsigned) sprintf((char *) data + len, "%02X\r\n",
+                                  (uint8_t) -sum);
+    }
+    len += (unsigned) sprintf((char *) data + len, ":00000001FF\r\n");
+    return len;
+}
+
+// ****************************************************************************
+// The host side of CMD_WIND, go back N: keep WINDBLOCKS blocks unACKed,
+// and on a NAK, or no reply, send again from the block asked for.
+// Returns the chars sent, and the blocks sent again in *resent.
+//
+static unsigned window_block(unsigned b)
+{
+    unsigned start = b * WINDSIZE;
+    unsigned n     = DEVSIZE - start < WINDSIZE ? DEVSIZE - start : WINDSIZE;
+    uint16_t crc   = 0xffff;
+    unsigned i;
+    int      j;
+
+    data[0] = (uint8_t) b;
+    data[1] = (uint8_t) n;
+    memcpy(data + 2, image + start, n);
+    for (i = 0; i < n + 2; ++i) {
+        crc ^= (uint16_t) (data[i] << 8);
+        for (j = 0; j < 8; ++j) {
+            crc = (crc & 0x8000) ? (uint16_t) ((crc << 1) ^ 0x1021)
+                                 : (uint16_t) (crc << 1);
+        }
+    }
+    data[n + 2] = (uint8_t) (crc >> 8);
+    data[n + 3] = (uint8_t) crc;
+    host_send(data, n + 4);
+    return n + 4;
+}
+
+static unsigned write_window(unsigned *resent)
+{
+    unsigned blocks = (DEVSIZE + WINDSIZE - 1) / WINDSIZE;
+    unsigned base   = 0;           // oldest block not ACKed
+    unsigned next   = 0;           // next block to send
+    unsigned sent   = 0;
+    unsigned num;
+    char     r[4] = { 0 };
+
+    *resent = 0;
+    snprintf(reply, sizeof(reply), "$X%04x%04x", 0, DEVSIZE);
+    host_puts(reply);
+    while (base < blocks) {
+        while (next < blocks && next < base + WINDBLOCKS) {
+            sent += window_block(next++);
+        }
+        if (host_recv(r, 3, ACK_MS) != 3) {
+            *resent += next - base;
+            next = base;
+            continue;
+        }
+        if ((r[0] != '+' && r[0] != '-') || sscanf(r + 1, "%2x", &num) != 1) {
+            break;
+        }
+        // The block numbers wrap at 256
+        num = base + ((num - base) & 0xff);
+        if (r[0] == '+') {
+            base = num + 1;
+        }
+        else {
+            *resent += next - num;
+            base = next = num;
+        }
+    }
+    cmd("", 0, 0, 2, 0);
+    return sent;
+}
+
+// ****************************************************************************
+// The scenarios. Each runs at every rate in benchBauds.
+//
+static void bench_read(void)
+{
+    uint8_t  m;
+    unsigned n;
+    double   ms;
+
+    rom_load();
+    for (m = 0; m <= MODE_BINARY; ++m) {
+        set_mode(m);
+        n = cmd("$1", 0, 0, 0, &ms);
+        result("read", m, ms, n, read_matches(n, m & MODE_BINARY));
+    }
+    for (m = 0; m <= MODE_BINARY; ++m) {
+        set_mode(m);
+        n = cmd("$Z00000800", 0, 0, 0, &ms);
+        result("packed", m, ms, n, packed_matches(n, m & MODE_BINARY));
+    }
+}
+
+static void bench_blank(void)
+{
+    unsigned n;
+    double   ms;
+
+    rom_erase();
+    set_mode(0);
+    n = cmd("$3", 0, 0, 2, &ms);
+    result("blank", 0, ms, n, strcmp(reply, "OK") == 0);
+    n = cmd("$P", 0, 0, 0, &ms);
+    result("pagemap", 0, ms, n, strcmp(reply, "0000 0000") == 0);
+}
+
+static void bench_verify(void)
+{
+    char     c[16];
+    char     want[8];
+    unsigned i;
+    unsigned n;
+    double   ms;
+
+    // A changed byte, so one page is sent back
+    rom_load();
+    sim_rom[0].cell[0x123] ^= 0x01;
+    set_mode(0);
+    snprintf(c, sizeof(c), "$C%04x%04x", 0, DEVSIZE);
+    snprintf(want, sizeof(want), "%04x", crc16(sim_rom[0].cell, DEVSIZE));
+    n = cmd(c, 0, 0, 4, &ms);
+    result("crc", 0, ms, n, strcmp(reply, want) == 0);
+
+    for (i = 0; i < DEVSIZE / PAGESIZE; ++i) {
+        snprintf((char *) data + 4*i, 5, "%04x",
+                 crc16(image + i * PAGESIZE, PAGESIZE));
+    }
+    set_mode(0);
+    n = cmd("$V", data, 4 * DEVSIZE / PAGESIZE, 0, &ms);
+    result("pagediff", 0, ms, n, n > 0 && strncmp(reply, "0100:", 5) == 0);
+    set_mode(MODE_BINARY);
+    n = cmd("$V", data, 4 * DEVSIZE / PAGESIZE, 0, &ms);
+    result("pagediff", MODE_BINARY, ms, n,
+           n == 2 + 2 + 4 * (64 + 2) + 2 && reply[1] == 0x01);
+}
+
+static void bench_write(void)
+{
+    static const uint8_t modes[] = {
+        MODE_FAST | MODE_SKIPFF, MODE_BINARY | MODE_FAST | MODE_SKIPFF
+    };
+    char     c[16];
+    unsigned i;
+    unsigned n;
+    double   ms;
+
+    snprintf(c, sizeof(c), "$W%04x%04x", 0, DEVSIZE);
+    for (i = 0; i < sizeof(modes); ++i) {
+        uint8_t m = modes[i];
+        rom_erase();
+        set_mode(m);
+        n = (m & MODE_BINARY) ? encode_frames(image, DEVSIZE, 64)
+                              : encode_hex(image, DEVSIZE);
+        cmd(c, data, n, 2, &ms);
+        result("write", m, ms, n, strcmp(reply, "OK") == 0 && rom_is_image());
+    }
+
+    // Double buffered blocks, each ACKed
+    rom_erase();
+    set_mode(MODE_BINARY | MODE_FAST | MODE_SKIPFF);
+    snprintf(c, sizeof(c), "$K%04x%04x", 0, DEVSIZE);
+    n = encode_frames(image, DEVSIZE, 64);
+    cmd(c, data, n, DEVSIZE / 256 + 2, &ms);
+    result("blocks", MODE_BINARY | MODE_FAST, ms, n,
+           strcmp(reply + DEVSIZE / 256, "OK") == 0 && rom_is_image());
+
+    // Intel HEX, only the records that aren't blank
+    rom_erase();
+    set_mode(MODE_FAST | MODE_SKIPFF);
+    n = encode_ihex(image, DEVSIZE);
+    cmd("$H", data, n, 2, &ms);
+    result("hex", MODE_FAST, ms, n, strcmp(reply, "OK") == 0 && rom_is_image());
+
+    // Windowed CRC blocks, on a clean link and on one losing chars
+    for (i = 0; i < 2; ++i) {
+        unsigned resent;
+        uint64_t t0 = sim_now_ns();
+        rom_erase();
+        set_mode(MODE_FAST | MODE_SKIPFF);
+        host_line_errors(i ? ERR_EVERY : 0);
+        n = write_window(&resent);
+        host_line_errors(0);
+        ms = (host_last_rx_ns() - t0) / 1e6;
+        result(i ? "lossy" : "window", MODE_BINARY | MODE_FAST, ms, n,
+               strcmp(reply, "OK") == 0 && rom_is_image());
+        if (resent) {
+            printf("         %u blocks sent again\n", resent);
+        }
+    }
+
+    // Classic 50mS pulses, a page only as it is slow
+    rom_erase();
+    set_mode(MODE_SKIPFF);
+    snprintf(c, sizeof(c), "$W%04x%04x", 0, PAGESIZE);
+    n = encode_hex(image, PAGESIZE);
+    cmd(c, data, n, 2, &ms);
+    result("classic", 0, ms, n, strcmp(reply, "OK") == 0 &&
+           memcmp(sim_rom[0].cell, image, PAGESIZE) == 0);
+}
+
+// ****************************************************************************
+// Give up on cmd c after ms, as the host would: drop what is unsent and
+// send a BREAK. Times the reply to it, which should end "ABORT\n", and
+// checks the firmware stopped programming and takes the next cmd, sent
+// once the host has been quiet for QUIET_MS after the reply.
+//
+static void abort_after(const char *what, const char *c, unsigned dn,
+                        uint32_t ms, uint8_t m)
+{
+    uint32_t pulses;
+    uint64_t t0;
+    unsigned n = 0;
+    double   took;
+    bool     ok;
+
+    host_puts(c);
+    host_send(data, dn);
+    host_idle(ms);
+    host_flush();
+    t0 = sim_now_ns();
+    host_break(1);
+    while (n < REPLYSIZE - 1 && host_recv(reply + n, 1, 1000) == 1) {
+        reply[++n] = 0;
+        if (n >= 6 && strcmp(reply + n - 6, "ABORT\n") == 0) {
+            break;
+        }
+    }
+    took = n ? (host_last_rx_ns() - t0) / 1e6 : 0;
+    reply[n] = 0;
+    ok = n >= 6 && strcmp(reply + n - 6, "ABORT\n") == 0;
+    pulses = sim_rom[0].pulses;
+    host_idle(2 * QUIET_MS);
+    ok = ok && cmd("$4", 0, 0, 4, 0) == 4 && strcmp(reply, "2716") == 0;
+    host_idle(200);
+    ok = ok && sim_rom[0].pulses == pulses;
+    result(what, m, took, n, ok);
+}
+
+static void bench_abort(void)
+{
+    char     c[16];
+    unsigned n;
+
+    // A classic write, 50mS pulses
+    rom_erase();
+    set_mode(0);
+    snprintf(c, sizeof(c), "$W%04x%04x", 0, DEVSIZE);
+    n = encode_hex(image, DEVSIZE);
+    abort_after("abort W", c, n, 1000, 0);
+
+    // A fast write in binary frames
+    rom_erase();
+    set_mode(MODE_BINARY | MODE_FAST);
+    n = encode_frames(image, DEVSIZE, 64);
+    abort_after("abort W", c, n, 1000, MODE_BINARY | MODE_FAST);
+
+    // A read, mid reply
+    rom_load();
+    set_mode(0);
+    abort_after("abort 1", "$1", 0, 20, 0);
+}
+
+// ****************************************************************************
+// Two sockets, on sim-gang --gang 2. Both are written at once. Then a bit
+// that won't program, and a cell that needs erasing, each drop socket 1
+// alone. The reply must name it, socket 0 must still get the image, and
+// CMD_GANG must read each socket back as it is.
+//
+static void gang_fail_reply(char *want, unsigned size, uint16_t a,
+                            const char *why)
+{
+    snprintf(want, size, "Socket 1: %s at address 0x%04x\n"
+             "Failed sockets 02\n", why, a);
+}
+
+static bool gang_reads(void)
+{
+    char     c[16];
+    char     g[8];
+    char     want[8];
+    unsigned s;
+    bool     ok = true;
+
+    snprintf(c, sizeof(c), "$C%04x%04x", 0, DEVSIZE);
+    for (s = 0; s < 2; ++s) {
+        snprintf(g, sizeof(g), "$G%u", s);
+        snprintf(want, sizeof(want), "%04x", crc16(sim_rom[s].cell, DEVSIZE));
+        ok = ok && cmd_ok(g);
+        ok = ok && cmd(c, 0, 0, 4, 0) == 4 && strcmp(reply, want) == 0;
+    }
+    return cmd_ok("$G0") && ok;
+}
+
+static void bench_gang(void)
+{
+    const uint8_t m = MODE_BINARY | MODE_FAST | MODE_SKIPFF;
+    char     c[16];
+    char     want[64];
+    uint16_t stuck = 0;
+    uint16_t used  = 0;
+    unsigned n;
+    double   ms;
+    bool     ok;
+
+    cmd("$G1", 0, 0, 0, 0);
+    if (sim_sockets() != 2 || strcmp(reply, "OK") != 0 || !cmd_ok("$G0")) {
+        result("gang", m, 0, 0, false);
+        printf("         needs sim-gang --gang 2\n");
+        return;
+    }
+
+    // A code byte with bit 0 clear, and one that isn't 0
+    while (image[stuck] & 0x01) {
+        ++stuck;
+    }
+    while (image[used] == 0x00 || image[used] == 0xff) {
+        ++used;
+    }
+    snprintf(c, sizeof(c), "$W%04x%04x", 0, DEVSIZE);
+    n = encode_frames(image, DEVSIZE, 64);
+    set_mode(m);
+
+    // Both sockets good
+    rom_erase();
+    cmd(c, data, n, 2, &ms);
+    ok = strcmp(reply, "OK") == 0 && socket_is_image(0) && socket_is_image(1);
+    result("gang", m, ms, n, ok && gang_reads());
+
+    // Socket 1 can't program bit 0 at stuck
+    rom_erase();
+    sim_rom[1].stuck[stuck] = 0x01;
+    gang_fail_reply(want, sizeof(want), stuck, "Write fail");
+    cmd(c, data, n, strlen(want), &ms);
+    sim_rom[1].stuck[stuck] = 0;
+    host_idle(2 * QUIET_MS);
+    ok = strcmp(reply, want) == 0 && socket_is_image(0);
+    result("gangfail", m, ms, n, ok && gang_reads());
+
+    // Socket 1 has a cell programmed to 0 at used
+    rom_erase();
+    sim_rom[1].cell[used] = 0x00;
+    gang_fail_reply(want, sizeof(want), used, "Conflict");
+    cmd(c, data, n, strlen(want), &ms);
+    host_idle(2 * QUIET_MS);
+    ok = strcmp(reply, want) == 0 && socket_is_image(0) &&
+         memcmp(sim_rom[1].cell, image, used) == 0;
+    result("gangconf", m, ms, n, ok && gang_reads());
+}
+
+// ****************************************************************************
+// sim --bench [read|blank|verify|write|abort|gang ...], all but gang by
+// default, which needs sim-gang --gang 2. Exits 1 if any result was wrong.
+//
+int bench_main(int argc, char **argv)
+{
+    static const struct {
+        const char *name;
+        void      (*run)(void);
+        bool        named;         // only run when asked for
+    } scenarios[] = {
+        { "read",   bench_read,   false },
+        { "blank",  bench_blank,  false },
+        { "verify", bench_verify, false },
+        { "write",  bench_write,  false },
+        { "abort",  bench_abort,  false },
+        { "gang",   bench_gang,   true  },
+    };
+    unsigned s;
+    unsigned b;
+    int      i;
+
+    make_image();
+    for (s = 0; s < sizeof(scenarios) / sizeof(scenarios[0]); ++s) {
+        bool want = argc == 0 && !scenarios[s].named;
+        for (i = 0; i < argc; ++i) {
+            want = want || strcmp(argv[i], scenarios[s].name) == 0;
+        }
+        if (!want) {
+            continue;
+        }
+        for (b = 0; b < NBENCH; ++b) {
+            if (!link_at(benchBauds[b])) {
+                printf("can't get the link to %u\n", benchBauds[b]);
+                return 1;
+            }
+            scenarios[s].run();
+        }
+    }
+    sim_report(stdout);
+    return allOk ? 0 : 1;
+}
@@ -0,0 +1,1063 @@
+// ****************************************************************************
+//
+// File                 : sim.c
+// Description          : Host simulation of the PIC16F1789 peripherals the
+//                        firmware uses, and of the EPROM in the socket.
+//
+//                        Time is virtual, in nS. Each register access costs
+//                        a few instruction cycles, __delay_*() cost what
+//                        they say, and between them the timers, CCP1, the
+//                        UART and the EPROM run. The isr is called when an
+//                        interrupt is pending and enabled, as it would be
+//                        taken on the PIC.
+//
+//                        The serial line is either a pty, paced against
+//                        real time so the host application can be used
+//                        (sim --pty), or the coroutine in bench.c (sim
+//                        --bench), which is deterministic.
+//
+// ****************************************************************************
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <setjmp.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <ucontext.h>
+#include <unistd.h>
+
+#include "xc.h"
+#include "sim.h"
+
+#define FOSC       20000000u
+#define CYCLE_NS   (4000000000u / FOSC)  // 200nS instruction cycle
+#define NOP_CYCLES 3                     // a NOP and its loop
+
+// The firmware, built with -Dmain=fw_main
+void fw_main(void);
+void isr(void);
+
+// Registers
+volatile sim_porta_t   sim_LATA;
+volatile sim_portc_t   sim_LATC;
+volatile sim_porte_t   sim_LATE;
+volatile sim_trisa_t   sim_TRISA;
+volatile sim_trisc_t   sim_TRISC;
+volatile sim_trise_t   sim_TRISE;
+volatile sim_intcon_t  sim_INTCON;
+volatile sim_pie1_t    sim_PIE1;
+volatile sim_pir1_t    sim_PIR1;
+volatile sim_pir2_t    sim_PIR2;
+volatile sim_txsta_t   sim_TXSTA;
+volatile sim_rcsta_t   sim_RCSTA;
+volatile sim_baudcon_t sim_BAUDCON;
+volatile sim_adcon0_t  sim_ADCON0;
+volatile sim_option_t  sim_OPTION_REG;
+volatile sim_t1con_t   sim_T1CON;
+volatile sim_eecon1_t  sim_EECON1;
+volatile sim_ccp1con_t sim_CCP1CON;
+volatile uint8_t sim_LATB, sim_LATD, sim_TRISB, sim_TRISD;
+volatile uint8_t sim_ANSELA, sim_ANSELB, sim_ANSELC, sim_ANSELD;
+volatile uint8_t sim_ANSELE, sim_SPBRGL, sim_SPBRGH, sim_TMR0;
+volatile uint8_t sim_TMR1H, sim_TMR1L, sim_CCPR1H, sim_CCPR1L;
+volatile uint8_t sim_EEADRL, sim_EEADRH, sim_EEDATL, sim_EECON2;
+
+sim_rom_t sim_rom[SIM_SOCKETS];
+static int sockets = 1;            // --gang, sockets on the board
+static uint32_t clashReads;        // reads with two sockets driving
+
+static uint64_t now;               // virtual nS since reset
+static int      accessCycles = 2;  // cycles per register access
+static bool     inIsr;
+
+// Timers
+static uint64_t t0Ns;              // nS towards the next TMR0 count
+static uint64_t t1Ns;              // and TMR1
+static uint8_t  ccpMode;           // CCP1M last seen
+static bool     ccpDrive;          // CCP1 has RC2
+static bool     ccpPin;            // and drives it to this
+
+// EPROM pins, to check the firmware waits long enough
+static uint16_t lastAddr;
+static unsigned lastEnable;
+static uint8_t  lastTrisd;
+static uint64_t settleNs;          // when the outputs last changed
+static uint32_t taccNs = 450;      // --tacc, access time of the EPROM
+static bool     wasProg[SIM_SOCKETS];
+static int      devKind = -1;      // -1 from the relays, else 0/1/2
+static uint16_t devSize;           // 0 from the relays
+
+// Data EEPROM
+static uint8_t  eeData[256];
+static const char *eeFile;
+static uint64_t eeDoneNs;          // write in progress until then
+
+// UART. The host sends a byte whenever CTS_ was low at the start of it,
+// with ctsLag bytes more after CTS_ goes high, as the FTDI chips do.
+#define HOSTQ 65536
+static uint8_t  hostTx[HOSTQ];     // host to PIC, not yet on the line
+static unsigned hostTxHead, hostTxTail;
+static uint8_t  hostRx[HOSTQ];     // PIC to host, not yet read
+static unsigned hostRxHead, hostRxTail;
+static uint64_t lastRxNs;
+static uint32_t hostBaud = 115200;
+static int      ctsLag = 2;
+static int      ctsSent;           // bytes sent since CTS_ went high
+static bool     rxBusy;            // a byte is on the line to the PIC
+static uint8_t  rxByte;
+static uint64_t rxDoneNs;
+static uint8_t  rxFifo[2];         // the PIC's receive FIFO
+static bool     rxFerr[2];
+static uint32_t errEvery;          // --errors, every Nth char is a FERR
+static bool     breakReq;          // host_break(), once hostTx gets to
+static unsigned breakAt;           // here
+static uint32_t breakMs;           // and for this long
+static bool     rxBreak;           // the byte on the line is a BREAK
+static uint64_t breakEndNs;        // the line is low until then
+static uint32_t rxChars;           // chars the firmware has received
+static int      rxCount;
+static bool     txArmed;           // TXREG written since the last step
+static uint8_t  txSlot;
+static bool     tsrBusy;
+static uint8_t  tsrByte;
+static uint64_t tsrDoneNs;
+static bool     txregFull;
+static uint8_t  txregByte;
+
+// The two ways of running the host side
+static int      ptyFd = -1, ptySlave = -1;
+static double   speed = 1.0;
+static struct timespec realStart;
+static uint64_t nextPtyNs;
+
+static bool       bench;
+static ucontext_t hostCtx, fwCtx;
+static bool       hostWaiting;
+static unsigned   wantBytes;
+static uint64_t   deadlineNs;
+static uint64_t   quietNs, quietFrom;
+
+static jmp_buf    resetJmp;
+static volatile sig_atomic_t quit;
+
+// ****************************************************************************
+// Baud rates
+//
+static uint32_t brg_baud(void)
+{
+    uint32_t n = ((uint32_t) sim_SPBRGH << 8 | sim_SPBRGL) + 1;
+    uint32_t div = sim_BAUDCON.b.BRG16 ? (sim_TXSTA.b.BRGH ? 4 : 16)
+                                       : (sim_TXSTA.b.BRGH ? 16 : 64);
+    return FOSC / (div * n);
+}
+
+uint32_t sim_fw_baud(void)
+{
+    return brg_baud();
+}
+
+int sim_sockets(void)
+{
+    return sockets;
+}
+
+static bool baud_ok(void)
+{
+    uint32_t b = brg_baud();
+    uint32_t d = b > hostBaud ? b - hostBaud : hostBaud - b;
+    return d * 100 <= hostBaud * 3;
+}
+
+static uint64_t byte_ns(uint32_t baud)
+{
+    return 10ull * 1000000000ull / baud;
+}
+
+// ****************************************************************************
+// The EPROM. The kind follows the relays unless --dev says otherwise:
+// 0 is the 2716 family, 1 the 2732 (RLA), 2 the 2532 (RLB), and 3 the
+// 2708 adaptor, wired as 2708prg.X drives it.
+//
+static int rom_kind(void)
+{
+    if (devKind >= 0) {
+        return devKind;
+    }
+    if (sim_LATE.v & 0x01) {
+        return 1;
+    }
+    if (sim_LATE.v & 0x02) {
+        return 2;
+    }
+    return 0;
+}
+
+static uint16_t rom_addr(void)
+{
+    uint16_t size = devSize ? devSize : (rom_kind() ? 4096 : 2048);
+    uint16_t a = (uint16_t) ((sim_LATA.v & 0x0f) << 8 | sim_LATB);
+    return a & (size - 1);
+}
+
+static bool pin_rc2(void)
+{
+    return ccpDrive ? ccpPin : sim_LATC.lat.LATC2;
+}
+
+// The control lines reach socket s. Ganged, each is gated, socket 0 by
+// RE2 and socket 1 by RC5.
+static bool rom_gated(int s)
+{
+    if (sockets == 1) {
+        return true;
+    }
+    return s == 0 ? sim_LATE.lat.LATE2 : sim_LATC.lat.LATC5;
+}
+
+// Outputs enabled
+static bool rom_enabled(int s)
+{
+    bool cs  = sim_LATC.lat.LATC0;
+    bool we  = sim_LATC.lat.LATC1;
+    bool pgm = pin_rc2();
+
+    if (!rom_gated(s)) {
+        return false;
+    }
+    switch (rom_kind()) {
+        case 0:  return !cs && !pgm;         // CS_ and PGM low, VPP either
+        case 1:  return !cs && !pgm && we;   // G_ and E_ low, VPP off
+        case 3:  return cs && !we && pgm;    // RC0 high, RC1 low, RC2 high
+        default: return !pgm && we;          // PD/PGM_ low, VPP off
+    }
+}
+
+// VPP on, and a program pulse
+static bool rom_programming(int s)
+{
+    bool cs  = sim_LATC.lat.LATC0;
+    bool we  = sim_LATC.lat.LATC1;
+    bool pgm = pin_rc2();
+
+    if (we || !rom_gated(s)) {
+        return false;
+    }
+    switch (rom_kind()) {
+        case 0:  return cs && pgm;           // PGM high, CS_ high
+        case 1:  return cs && !pgm;          // G_ at VPP, E_ low
+        case 3:  return !cs && !pgm;         // RC0 low, RC2 pulsed low
+        default: return !pgm;                // PD/PGM_ low
+    }
+}
+
+static void rom_segment(uint64_t ns)
+{
+    for (int s = 0; s < sockets; ++s) {
+        sim_rom_t *r = &sim_rom[s];
+        bool prog = rom_programming(s);
+
+        if (prog && !wasProg[s]) {
+            r->pulses++;
+        }
+        wasProg[s] = prog;
+        if (!prog || ns == 0) {
+            continue;
+        }
+        uint16_t a = rom_addr();
+        uint8_t  d = sim_TRISD == 0 ? sim_LATD : 0xff;
+        r->pulseTotalNs += ns;
+        r->pulseNs[a]   += (uint32_t) ns;
+        if (r->pulseNs[a] >= r->progNs) {
+            r->cell[a] &= d | r->stuck[a];
+        }
+    }
+}
+
+// The sockets with their outputs on, a bit each
+static unsigned rom_driving(void)
+{
+    unsigned m = 0;
+    for (int s = 0; s < sockets; ++s) {
+        if (rom_enabled(s)) {
+            m |= 1u << s;
+        }
+    }
+    return m;
+}
+
+uint8_t sim_portd(void)
+{
+    sim_io(0);
+    if (sim_TRISD != 0xff) {
+        return sim_LATD;
+    }
+    unsigned m = rom_driving();
+    if (m == 0) {
+        sim_rom[0].hiddenReads++;
+        return 0xa5;
+    }
+    if (now - settleNs < taccNs) {
+        sim_rom[0].badReads++;
+        return 0x5a;
+    }
+    if (m & (m - 1)) {
+        clashReads++;
+    }
+    uint8_t d = 0xff;
+    for (int s = 0; s < sockets; ++s) {
+        if (m & (1u << s)) {
+            d &= sim_rom[s].cell[rom_addr()];
+        }
+    }
+    return d;
+}
+
+// ****************************************************************************
+// Data EEPROM
+//
+static void ee_save(void)
+{
+    if (eeFile) {
+        FILE *f = fopen(eeFile, "wb");
+        if (f) {
+            fwrite(eeData, 1, sizeof(eeData), f);
+            fclose(f);
+        }
+    }
+}
+
+static void ee_step(void)
+{
+    if (sim_EECON1.b.RD) {
+        sim_EEDATL = eeData[sim_EEADRL];
+        sim_EECON1.b.RD = 0;
+    }
+    if (sim_EECON1.b.WR && eeDoneNs == 0) {
+        if (sim_EECON1.b.WREN) {
+            eeDoneNs = now + 4000000;
+        }
+        else {
+            sim_EECON1.b.WR = 0;
+        }
+    }
+    if (eeDoneNs && now >= eeDoneNs) {
+        eeData[sim_EEADRL] = sim_EEDATL;
+        ee_save();
+        eeDoneNs = 0;
+        sim_EECON1.b.WR = 0;
+        sim_PIR2.b.EEIF = 1;
+    }
+}
+
+// ****************************************************************************
+// The serial line
+//
+static void host_rx_put(uint8_t c)
+{
+    hostRx[hostRxTail] = c;
+    hostRxTail = (hostRxTail + 1) % HOSTQ;
+    lastRxNs = now;
+}
+
+static unsigned host_rx_count(void)
+{
+    return (hostRxTail - hostRxHead + HOSTQ) % HOSTQ;
+}
+
+static void tx_write(uint8_t c)
+{
+    if (!sim_TXSTA.b.TXEN) {
+        return;
+    }
+    if (!tsrBusy) {
+        tsrBusy   = true;
+        tsrByte   = c;
+        tsrDoneNs = now + byte_ns(brg_baud());
+    }
+    else {
+        txregFull = true;
+        txregByte = c;
+    }
+}
+
+static void tx_done(void)
+{
+    host_rx_put(baud_ok() ? tsrByte : 0xff);
+    tsrBusy = false;
+    if (txregFull) {
+        txregFull = false;
+        tx_write(txregByte);
+    }
+}
+
+static void rx_start(void)
+{
+    if (rxBusy || now < breakEndNs) {
+        return;
+    }
+    if (!sim_RCSTA.b.SPEN || !sim_RCSTA.b.CREN) {
+        return;
+    }
+    if (breakReq && hostTxHead == breakAt) {
+        // Received as a 0 with a framing error, CTS or not
+        breakReq   = false;
+        rxBusy     = true;
+        rxBreak    = true;
+        rxByte     = 0;
+        rxDoneNs   = now + byte_ns(hostBaud);
+        breakEndNs = now + breakMs * 1000000ull;
+        return;
+    }
+    if (hostTxHead == hostTxTail) {
+        return;
+    }
+    if (sim_LATA.lat.LATA4) {
+        if (ctsSent >= ctsLag) {
+            return;
+        }
+        ctsSent++;
+    }
+    else {
+        ctsSent = 0;
+    }
+    rxBusy   = true;
+    rxByte   = hostTx[hostTxHead];
+    hostTxHead = (hostTxHead + 1) % HOSTQ;
+    rxDoneNs = now + byte_ns(hostBaud);
+}
+
+static void rx_done(void)
+{
+    bool brk = rxBreak;
+
+    rxBusy  = false;
+    rxBreak = false;
+    if (sim_BAUDCON.b.ABDEN) {
+        // Auto baud measures the 'U' and leaves junk in RCREG
+        uint32_t n = (FOSC / 4 + hostBaud / 2) / hostBaud - 1;
+        sim_SPBRGH = n >> 8;
+        sim_SPBRGL = n & 0xff;
+        sim_BAUDCON.b.ABDEN = 0;
+        rxByte = 0;
+    }
+    if (sim_RCSTA.b.OERR) {
+        return;
+    }
+    if (rxCount == 2) {
+        sim_RCSTA.b.OERR = 1;
+        return;
+    }
+    rxFerr[rxCount] = brk || !baud_ok() ||
+                      (errEvery && ++rxChars % errEvery == 0);
+    rxFifo[rxCount] = rxFerr[rxCount] ? 0 : rxByte;
+    rxCount++;
+}
+
+uint8_t sim_rcreg(void)
+{
+    sim_io(0);
+    uint8_t c = rxFifo[0];
+    if (rxCount) {
+        rxFifo[0] = rxFifo[1];
+        rxFerr[0] = rxFerr[1];
+        rxCount--;
+    }
+    sim_PIR1.b.RCIF  = rxCount != 0;
+    sim_RCSTA.b.FERR = rxCount && rxFerr[0];
+    return c;
+}
+
+volatile uint8_t *sim_txreg(void)
+{
+    sim_io(0);
+    txArmed = true;
+    sim_PIR1.b.TXIF = 0;
+    return &txSlot;
+}
+
+// ****************************************************************************
+// What happened to the EPROM
+//
+void sim_report(FILE *f)
+{
+    fprintf(f, "%.3fs: %u pulses, %.1fms, %u early reads, "
+               "%u reads with outputs off",
+            now / 1e9, sim_rom[0].pulses, sim_rom[0].pulseTotalNs / 1e6,
+            sim_rom[0].badReads, sim_rom[0].hiddenReads);
+    for (int s = 1; s < sockets; ++s) {
+        fprintf(f, ", socket %d %u pulses, %.1fms", s, sim_rom[s].pulses,
+                sim_rom[s].pulseTotalNs / 1e6);
+    }
+    if (sockets > 1) {
+        fprintf(f, ", %u reads with 2 driving", clashReads);
+    }
+    fputc('\n', f);
+}
+
+static void on_signal(int sig)
+{
+    (void) sig;
+    quit = 1;
+}
+
+// ****************************************************************************
+// The pty, paced against real time
+//
+static speed_t speeds[][2] = {
+    { B9600, 9600 }, { B19200, 19200 }, { B38400, 38400 },
+    { B57600, 57600 }, { B115200, 115200 }, { B230400, 230400 },
+    { B460800, 460800 }, { B500000, 500000 }, { B921600, 921600 },
+    { B1000000, 1000000 }
+};
+
+static void pty_service(void)
+{
+    struct termios t;
+    if (tcgetattr(ptySlave, &t) == 0) {
+        speed_t s = cfgetospeed(&t);
+        for (unsigned i = 0; i < sizeof(speeds) / sizeof(speeds[0]); ++i) {
+            if (speeds[i][0] == s) {
+                hostBaud = speeds[i][1];
+            }
+        }
+    }
+
+    uint8_t b[256];
+    unsigned room = HOSTQ - 1 - (hostTxTail - hostTxHead + HOSTQ) % HOSTQ;
+    ssize_t n = read(ptyFd, b, room < sizeof(b) ? room : sizeof(b));
+    for (ssize_t i = 0; i < n; ++i) {
+        hostTx[hostTxTail] = b[i];
+        hostTxTail = (hostTxTail + 1) % HOSTQ;
+    }
+    while (hostRxHead != hostRxTail) {
+        unsigned end = hostRxTail > hostRxHead ? hostRxTail : HOSTQ;
+        n = write(ptyFd, hostRx + hostRxHead, end - hostRxHead);
+        if (n <= 0) {
+            break;
+        }
+        hostRxHead = (hostRxHead + (unsigned) n) % HOSTQ;
+    }
+
+    if (quit) {
+        sim_report(stderr);
+        exit(0);
+    }
+
+    // Don't run ahead of real time
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    double real = (ts.tv_sec - realStart.tv_sec) * 1e9
+                + (ts.tv_nsec - realStart.tv_nsec);
+    double ahead = now / speed - real;
+    if (ahead > 1e6) {
+        usleep((useconds_t) (ahead / 1000));
+    }
+}
+
+// ****************************************************************************
+// Run the peripherals for ns
+//
+static bool irq_pending(void)
+{
+    if (!sim_INTCON.b.GIE || inIsr) {
+        return false;
+    }
+    if (sim_INTCON.b.TMR0IE && sim_INTCON.b.TMR0IF) {
+        return true;
+    }
+    if (!sim_INTCON.b.PEIE) {
+        return false;
+    }
+    return (sim_PIE1.b.RCIE && sim_PIR1.b.RCIF)
+        || (sim_PIE1.b.TXIE && sim_PIR1.b.TXIF)
+        || (sim_PIE1.b.CCP1IE && sim_PIR1.b.CCP1IF);
+}
+
+static bool host_ready(void)
+{
+    if (!hostWaiting) {
+        return false;
+    }
+    if (host_rx_count() >= wantBytes || now >= deadlineNs) {
+        return true;
+    }
+    if (quietNs) {
+        uint64_t from = lastRxNs > quietFrom ? lastRxNs : quietFrom;
+        return now >= from + quietNs;
+    }
+    return false;
+}
+
+static void status_update(void)
+{
+    sim_PIR1.b.RCIF  = rxCount != 0;
+    sim_RCSTA.b.FERR = rxCount && rxFerr[0];
+    sim_PIR1.b.TXIF  = !txregFull && !txArmed;
+    sim_TXSTA.b.TRMT = !tsrBusy && !txregFull;
+}
+
+static void advance(uint64_t ns)
+{
+    uint64_t target = now + ns;
+
+    do {
+        uint64_t next = target;
+
+        rx_start();
+        if (rxBusy && rxDoneNs < next) {
+            next = rxDoneNs;
+        }
+        if (tsrBusy && tsrDoneNs < next) {
+            next = tsrDoneNs;
+        }
+        if (eeDoneNs && eeDoneNs < next) {
+            next = eeDoneNs;
+        }
+
+        uint64_t t0Period = CYCLE_NS * (sim_OPTION_REG.b.PSA
+                                        ? 1 : 2u << sim_OPTION_REG.b.PS);
+        uint64_t t0Next = (256 - sim_TMR0) * t0Period - t0Ns;
+        if (now + t0Next < next) {
+            next = now + t0Next;
+        }
+
+        uint64_t t1Period = (uint64_t) CYCLE_NS << sim_T1CON.b.T1CKPS;
+        uint16_t t1 = (uint16_t) (sim_TMR1H << 8 | sim_TMR1L);
+        uint16_t ccpr = (uint16_t) (sim_CCPR1H << 8 | sim_CCPR1L);
+        bool compare = (sim_CCP1CON.v & 0x0c) == 0x08;
+        if (sim_T1CON.b.TMR1ON && compare) {
+            uint32_t counts = ((uint16_t) (ccpr - t1 - 1)) + 1u;
+            uint64_t t1Next = counts * t1Period - t1Ns;
+            if (now + t1Next < next) {
+                next = now + t1Next;
+            }
+        }
+
+        if (hostWaiting) {
+            uint64_t d = deadlineNs;
+            if (quietNs) {
+                uint64_t from = lastRxNs > quietFrom ? lastRxNs : quietFrom;
+                if (from + quietNs < d) {
+                    d = from + quietNs;
+                }
+            }
+            if (d > now && d < next) {
+                next = d;
+            }
+        }
+        if (ptyFd >= 0 && nextPtyNs > now && nextPtyNs < next) {
+            next = nextPtyNs;
+        }
+
+        // Run to the next event
+        uint64_t seg = next - now;
+        rom_segment(seg);
+
+        t0Ns += seg;
+        uint64_t n0 = t0Ns / t0Period;
+        t0Ns %= t0Period;
+        if (n0 >= (uint64_t) (256 - sim_TMR0)) {
+            sim_INTCON.b.TMR0IF = 1;
+        }
+        sim_TMR0 = (uint8_t) (sim_TMR0 + n0);
+
+        if (sim_T1CON.b.TMR1ON) {
+            t1Ns += seg;
+            uint64_t n1 = t1Ns / t1Period;
+            t1Ns %= t1Period;
+            if (compare && n1 >= ((uint16_t) (ccpr - t1 - 1)) + 1u) {
+                sim_PIR1.b.CCP1IF = 1;
+                ccpPin = (sim_CCP1CON.v & 0x0f) == 0x08;
+                rom_segment(0);
+            }
+            t1 = (uint16_t) (t1 + n1);
+            sim_TMR1H = t1 >> 8;
+            sim_TMR1L = t1 & 0xff;
+        }
+        now = next;
+
+        if (rxBusy && now >= rxDoneNs) {
+            rx_done();
+        }
+        if (tsrBusy && now >= tsrDoneNs) {
+            tx_done();
+        }
+        ee_step();
+        status_update();
+
+        if (ptyFd >= 0 && now >= nextPtyNs) {
+            nextPtyNs = now + 100000;
+            pty_service();
+        }
+        if (irq_pending()) {
+            inIsr = true;
+            sim_INTCON.b.GIE = 0;
+            isr();
+            sim_INTCON.b.GIE = 1;
+            inIsr = false;
+        }
+        if (host_ready()) {
+            swapcontext(&fwCtx, &hostCtx);
+        }
+    } while (now < target);
+}
+
+// ****************************************************************************
+// Look at what the firmware wrote since the last step
+//
+static void step(uint64_t ns)
+{
+    if (txArmed) {
+        txArmed = false;
+        tx_write(txSlot);
+    }
+
+    sim_LATC.port.RC7 = now >= breakEndNs;
+
+    uint8_t m = sim_CCP1CON.v & 0x0f;
+    if (m != ccpMode) {
+        ccpMode  = m;
+        ccpDrive = m == 0x08 || m == 0x09;
+        ccpPin   = m == 0x09;
+    }
+
+    uint16_t a = rom_addr();
+    unsigned e = rom_driving();
+    if (a != lastAddr || e != lastEnable || sim_TRISD != lastTrisd) {
+        lastAddr   = a;
+        lastEnable = e;
+        lastTrisd  = sim_TRISD;
+        settleNs   = now;
+    }
+
+    if (!sim_RCSTA.b.CREN) {
+        sim_RCSTA.b.OERR = 0;
+        rxCount = 0;
+    }
+    ee_step();
+    status_update();
+    advance(ns);
+}
+
+volatile void *sim_io(volatile void *reg)
+{
+    step((uint64_t) accessCycles * CYCLE_NS);
+    return reg;
+}
+
+void sim_nop(void)
+{
+    step(NOP_CYCLES * CYCLE_NS);
+}
+
+void sim_delay_ns(uint64_t ns)
+{
+    step(ns);
+}
+
+uint64_t sim_now_ns(void)
+{
+    return now;
+}
+
+// ****************************************************************************
+// Reset. The firmware's statics keep their values, only the registers
+// go back to their power on state.
+//
+static void por(void)
+{
+    sim_TRISA.v = sim_TRISC.v = sim_TRISE.v = 0xff;
+    sim_TRISB = sim_TRISD = 0xff;
+    sim_INTCON.v = 0;
+    sim_PIE1.v = 0;
+    sim_PIR1.v = 0;
+    sim_PIR2.v = 0;
+    sim_TXSTA.v = 0x02;
+    sim_RCSTA.v = 0;
+    sim_BAUDCON.v = 0;
+    sim_OPTION_REG.v = 0xff;
+    sim_T1CON.v = 0;
+    sim_CCP1CON.v = 0;
+    sim_SPBRGL = sim_SPBRGH = 0;
+    sim_EECON1.v = 0;
+    ccpMode = 0;
+    ccpDrive = false;
+    rxCount = 0;
+    txArmed = tsrBusy = txregFull = false;
+    eeDoneNs = 0;
+}
+
+void sim_asm(const char *s)
+{
+    if (strcmp(s, "RESET") == 0) {
+        longjmp(resetJmp, 1);
+    }
+}
+
+static void fw_entry(void)
+{
+    setjmp(resetJmp);
+    por();
+    fw_main();
+}
+
+void sim_init(int cycles)
+{
+    accessCycles = cycles;
+    for (int s = 0; s < SIM_SOCKETS; ++s) {
+        memset(sim_rom[s].cell, 0xff, sizeof(sim_rom[s].cell));
+    }
+    memset(eeData, 0xff, sizeof(eeData));
+    if (eeFile) {
+        FILE *f = fopen(eeFile, "rb");
+        if (f) {
+            if (fread(eeData, 1, sizeof(eeData), f) != sizeof(eeData)) {
+                memset(eeData, 0xff, sizeof(eeData));
+            }
+            fclose(f);
+        }
+    }
+}
+
+// ****************************************************************************
+// The bench side of the serial line. The firmware runs as a coroutine
+// while the host waits.
+//
+static void host_wait(unsigned want, uint64_t deadline, uint64_t quiet)
+{
+    wantBytes   = want;
+    deadlineNs  = deadline;
+    quietNs     = quiet;
+    quietFrom   = now;
+    hostWaiting = true;
+    if (!host_ready()) {
+        swapcontext(&hostCtx, &fwCtx);
+    }
+    hostWaiting = false;
+}
+
+void host_start(uint32_t baud)
+{
+    static char stack[1 << 20];
+    hostBaud = baud;
+    bench = true;
+    getcontext(&fwCtx);
+    fwCtx.uc_stack.ss_sp   = stack;
+    fwCtx.uc_stack.ss_size = sizeof(stack);
+    fwCtx.uc_link          = &hostCtx;
+    makecontext(&fwCtx, fw_entry, 0);
+}
+
+void host_set_baud(uint32_t baud)
+{
+    hostBaud = baud;
+}
+
+void host_send(const void *p, unsigned n)
+{
+    const uint8_t *b = p;
+    while (n--) {
+        hostTx[hostTxTail] = *b++;
+        hostTxTail = (hostTxTail + 1) % HOSTQ;
+    }
+}
+
+void host_puts(const char *s)
+{
+    host_send(s, (unsigned) strlen(s));
+}
+
+unsigned host_pending(void)
+{
+    return (hostTxTail - hostTxHead + HOSTQ) % HOSTQ;
+}
+
+unsigned host_recv(void *p, unsigned n, uint32_t timeoutMs)
+{
+    host_wait(n, now + timeoutMs * 1000000ull, 0);
+    unsigned got = 0;
+    uint8_t *b = p;
+    while (got < n && hostRxHead != hostRxTail) {
+        b[got++] = hostRx[hostRxHead];
+        hostRxHead = (hostRxHead + 1) % HOSTQ;
+    }
+    return got;
+}
+
+unsigned host_recv_quiet(char *p, unsigned max, uint32_t gapMs)
+{
+    host_wait(max, UINT64_MAX, gapMs * 1000000ull);
+    return host_recv(p, host_rx_count() < max ? host_rx_count() : max, 0);
+}
+
+void host_idle(uint32_t ms)
+{
+    host_wait(UINT32_MAX, now + ms * 1000000ull, 0);
+}
+
+void host_flush(void)
+{
+    hostTxHead = hostTxTail;
+}
+
+void host_break(uint32_t ms)
+{
+    breakReq = true;
+    breakAt  = hostTxTail;
+    breakMs  = ms;
+}
+
+void host_line_errors(uint32_t every)
+{
+    errEvery = every;
+    rxChars  = 0;
+}
+
+uint64_t host_last_rx_ns(void)
+{
+    return lastRxNs;
+}
+
+// ****************************************************************************
+// main
+//
+static void usage(void)
+{
+    fprintf(stderr,
+        "usage: sim [options] --pty | --bench [scenario...]\n"
+        "  --dev 2716|2732|2532|2708   EPROM in the socket, default from\n"
+        "                              the relays\n"
+        "  --fill FILE                 initial EPROM contents\n"
+        "  --stuck [S/]ADDR:MASK       bits at ADDR that won't program, in\n"
+        "                              socket S, default 0\n"
+        "  --gang N                    N gated sockets, RE2 and RC5\n"
+        "  --prog-us N                 pulse time a cell needs, default 2000\n"
+        "  --tacc N                    EPROM access time in nS, default 450\n"
+        "  --errors N                  every Nth char sent has a framing error\n"
+        "  --eeprom FILE               keep the data EEPROM in FILE\n"
+        "  --speed N                   pty: run N times real time\n"
+        "  --cycles N                  cycles per register access, default 2\n");
+    exit(2);
+}
+
+int main(int argc, char **argv)
+{
+    bool   pty = false;
+    int    cycles = 2;
+    const char *fill = 0;
+    uint32_t progUs = 2000;
+    int    i;
+
+    memset(sim_rom, 0, sizeof(sim_rom));
+    for (i = 1; i < argc; ++i) {
+        const char *a = argv[i];
+        const char *v = i + 1 < argc ? argv[i + 1] : 0;
+        if (strcmp(a, "--pty") == 0) {
+            pty = true;
+        }
+        else if (strcmp(a, "--bench") == 0) {
+            break;
+        }
+        else if (v && strcmp(a, "--dev") == 0) {
+            int d = atoi(v);
+            devKind = d == 2732 ? 1 : d == 2532 ? 2 : d == 2708 ? 3 : 0;
+            devSize = d == 2708 ? 1024 : devKind ? 4096 : 2048;
+            ++i;
+        }
+        else if (v && strcmp(a, "--fill") == 0) {
+            fill = v; ++i;
+        }
+        else if (v && strcmp(a, "--stuck") == 0) {
+            unsigned sock = 0, addr, mask;
+            if (sscanf(v, "%u/%x:%x", &sock, &addr, &mask) != 3 &&
+                (sock = 0, sscanf(v, "%x:%x", &addr, &mask) != 2)) {
+                usage();
+            }
+            if (addr >= SIM_ROMSIZE || sock >= SIM_SOCKETS) {
+                usage();
+            }
+            sim_rom[sock].stuck[addr] |= (uint8_t) mask;
+            ++i;
+        }
+        else if (v && strcmp(a, "--gang") == 0) {
+            sockets = atoi(v);
+            if (sockets < 1 || sockets > SIM_SOCKETS) {
+                usage();
+            }
+            ++i;
+        }
+        else if (v && strcmp(a, "--prog-us") == 0) {
+            progUs = (uint32_t) atoi(v); ++i;
+        }
+        else if (v && strcmp(a, "--errors") == 0) {
+            errEvery = (uint32_t) atoi(v); ++i;
+        }
+        else if (v && strcmp(a, "--tacc") == 0) {
+            taccNs = (uint32_t) atoi(v); ++i;
+        }
+        else if (v && strcmp(a, "--eeprom") == 0) {
+            eeFile = v; ++i;
+        }
+        else if (v && strcmp(a, "--speed") == 0) {
+            speed = atof(v); ++i;
+        }
+        else if (v && strcmp(a, "--cycles") == 0) {
+            cycles = atoi(v); ++i;
+        }
+        else {
+            usage();
+        }
+    }
+
+    sim_init(cycles);
+    for (int s = 0; s < SIM_SOCKETS; ++s) {
+        sim_rom[s].progNs = progUs * 1000;
+    }
+    if (fill) {
+        FILE *f = fopen(fill, "rb");
+        if (!f) {
+            perror(fill);
+            return 1;
+        }
+        if (fread(sim_rom[0].cell, 1, SIM_ROMSIZE, f) == 0) {
+            fprintf(stderr, "%s: empty\n", fill);
+        }
+        fclose(f);
+        for (int s = 1; s < SIM_SOCKETS; ++s) {
+            memcpy(sim_rom[s].cell, sim_rom[0].cell, SIM_ROMSIZE);
+        }
+    }
+
+    if (i < argc) {
+        return bench_main(argc - i - 1, argv + i + 1);
+    }
+    if (!pty) {
+        usage();
+    }
+
+    ptyFd = posix_openpt(O_RDWR | O_NOCTTY);
+    if (ptyFd < 0 || grantpt(ptyFd) || unlockpt(ptyFd)) {
+        perror("pty");
+        return 1;
+    }
+    ptySlave = open(ptsname(ptyFd), O_RDWR | O_NOCTTY);
+    struct termios t;
+    tcgetattr(ptySlave, &t);
+    cfmakeraw(&t);
+    cfsetspeed(&t, B115200);
+    tcsetattr(ptySlave, TCSANOW, &t);
+    fcntl(ptyFd, F_SETFL, O_NONBLOCK);
+    printf("%s\n", ptsname(ptyFd));
+    fflush(stdout);
+
+    signal(SIGTERM, on_signal);
+    signal(SIGINT, on_signal);
+    clock_gettime(CLOCK_MONOTONIC, &realStart);
+    fw_entry();
+    return 0;
+}
@@ -0,0 +1,58 @@
+// ****************************************************************************
+//
+// File                 : sim.h
+// Description          : Host simulation of the programmer. sim.c models
+//                        the PIC16F1789 peripherals the firmware uses and
+//                        an EPROM in the socket, in virtual time. bench.c
+//                        drives the firmware over the simulated serial
+//                        line with the host side of the protocol.
+//
+// ****************************************************************************
+
+#ifndef SIM_H
+#define SIM_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// The EPROM in each socket, and what happened to it
+#define SIM_ROMSIZE 4096
+#define SIM_SOCKETS 2
+typedef struct {
+    uint8_t  cell[SIM_ROMSIZE];    // contents
+    uint8_t  stuck[SIM_ROMSIZE];   // bits that won't program to 0
+    uint32_t pulseNs[SIM_ROMSIZE]; // program pulse time so far, per cell
+    uint32_t progNs;               // pulse time a cell needs to program
+    uint32_t pulses;               // program pulses given
+    uint64_t pulseTotalNs;         // and their total length
+    uint32_t badReads;             // reads before the data was valid
+    uint32_t hiddenReads;          // reads with the outputs disabled
+} sim_rom_t;
+extern sim_rom_t sim_rom[SIM_SOCKETS];
+
+// Firmware side, set up by sim_init()
+void     sim_init(int cyclesPerAccess);
+uint64_t sim_now_ns(void);
+uint32_t sim_fw_baud(void);
+int      sim_sockets(void);
+void     sim_report(FILE *f);
+
+// Host side of the serial line, for bench.c. The firmware only runs
+// while the host waits in host_recv() or host_idle().
+void     host_start(uint32_t baud);
+void     host_set_baud(uint32_t baud);
+void     host_send(const void *p, unsigned n);
+void     host_puts(const char *s);
+unsigned host_recv(void *p, unsigned n, uint32_t timeoutMs);
+unsigned host_recv_quiet(char *p, unsigned max, uint32_t gapMs);
+void     host_idle(uint32_t ms);
+void     host_flush(void);
+void     host_break(uint32_t ms);
+void     host_line_errors(uint32_t every);
+uint64_t host_last_rx_ns(void);
+unsigned host_pending(void);
+
+int      bench_main(int argc, char **argv);
+
+#endif // SIM_H
@@ -0,0 +1,202 @@
+// ****************************************************************************
+//
+// File                 : xc.h
+// Description          : Stand in for the XC8 <xc.h> when the firmware is
+//                        built on the host by sim/Makefile. The PIC16F1789
+//                        registers the firmware uses are modelled by sim.c.
+//
+//                        Every register access goes through sim_io(), which
+//                        advances virtual time by a few instruction cycles
+//                        and runs the peripherals, so busy loops that poll
+//                        a register make progress. __delay_*() advance
+//                        virtual time directly. Interrupts are taken at the
+//                        next register access once they are pending.
+//
+// ****************************************************************************
+
+#ifndef SIM_XC_H
+#define SIM_XC_H
+
+#include <stdint.h>
+
+#define __interrupt()
+
+void sim_nop(void);
+void sim_delay_ns(uint64_t ns);
+void sim_asm(const char *s);
+volatile void *sim_io(volatile void *reg);
+uint8_t sim_portd(void);
+uint8_t sim_rcreg(void);
+volatile uint8_t *sim_txreg(void);
+
+#define NOP()          sim_nop()
+#define asm(s)         sim_asm(s)
+#define __delay_us(x)  sim_delay_ns((uint64_t) (x) * 1000u)
+#define __delay_ms(x)  sim_delay_ns((uint64_t) (x) * 1000000u)
+
+// A register is a byte, with its bits named as in the XC8 headers.
+#define SIM_BITS8(a,b,c,d,e,f,g,h) \
+    struct { uint8_t a:1, b:1, c:1, d:1, e:1, f:1, g:1, h:1; }
+
+typedef union {
+    uint8_t v;
+    SIM_BITS8(LATA0,LATA1,LATA2,LATA3,LATA4,LATA5,LATA6,LATA7) lat;
+    SIM_BITS8(RA0,RA1,RA2,RA3,RA4,RA5,RA6,RA7) port;
+} sim_porta_t;
+typedef union {
+    uint8_t v;
+    SIM_BITS8(LATC0,LATC1,LATC2,LATC3,LATC4,LATC5,LATC6,LATC7) lat;
+    SIM_BITS8(RC0,RC1,RC2,RC3,RC4,RC5,RC6,RC7) port;
+} sim_portc_t;
+typedef union {
+    uint8_t v;
+    SIM_BITS8(LATE0,LATE1,LATE2,LATE3,LATE4,LATE5,LATE6,LATE7) lat;
+    SIM_BITS8(RE0,RE1,RE2,RE3,RE4,RE5,RE6,RE7) port;
+} sim_porte_t;
+typedef union {
+    uint8_t v;
+    SIM_BITS8(TRISA0,TRISA1,TRISA2,TRISA3,TRISA4,TRISA5,TRISA6,TRISA7) b;
+} sim_trisa_t;
+typedef union {
+    uint8_t v;
+    SIM_BITS8(TRISC0,TRISC1,TRISC2,TRISC3,TRISC4,TRISC5,TRISC6,TRISC7) b;
+} sim_trisc_t;
+typedef union {
+    uint8_t v;
+    SIM_BITS8(TRISE0,TRISE1,TRISE2,TRISE3,TRISE4,TRISE5,TRISE6,TRISE7) b;
+} sim_trise_t;
+typedef union {
+    uint8_t v;
+    SIM_BITS8(IOCIF,INTF,TMR0IF,IOCIE,INTE,TMR0IE,PEIE,GIE) b;
+} sim_intcon_t;
+typedef union {
+    uint8_t v;
+    SIM_BITS8(TMR1IE,TMR2IE,CCP1IE,SSP1IE,TXIE,RCIE,ADIE,TMR1GIE) b;
+} sim_pie1_t;
+typedef union {
+    uint8_t v;
+    SIM_BITS8(TMR1IF,TMR2IF,CCP1IF,SSP1IF,TXIF,RCIF,ADIF,TMR1GIF) b;
+} sim_pir1_t;
+typedef union {
+    uint8_t v;
+    SIM_BITS8(CCP2IF,C3IF,C4IF,BCL1IF,EEIF,C1IF,C2IF,OSFIF) b;
+} sim_pir2_t;
+typedef union {
+    uint8_t v;
+    SIM_BITS8(TX9D,TRMT,BRGH,SENDB,SYNC,TXEN,TX9,CSRC) b;
+} sim_txsta_t;
+typedef union {
+    uint8_t v;
+    SIM_BITS8(RX9D,OERR,FERR,ADDEN,CREN,SREN,RX9,SPEN) b;
+} sim_rcsta_t;
+typedef union {
+    uint8_t v;
+    SIM_BITS8(ABDEN,WUE,BAUD_2,BRG16,SCKP,BAUD_5,RCIDL,ABDOVF) b;
+} sim_baudcon_t;
+typedef union {
+    uint8_t v;
+    SIM_BITS8(ADON,GO_nDONE,CHS0,CHS1,CHS2,CHS3,CHS4,ADRMD) b;
+} sim_adcon0_t;
+typedef union {
+    uint8_t v;
+    struct { uint8_t PS:3, PSA:1, TMR0SE:1, TMR0CS:1, INTEDG:1, nWPUEN:1; } b;
+} sim_option_t;
+typedef union {
+    uint8_t v;
+    struct { uint8_t TMR1ON:1, :1, nT1SYNC:1, T1OSCEN:1, T1CKPS:2, TMR1CS:2; } b;
+} sim_t1con_t;
+typedef union {
+    uint8_t v;
+    SIM_BITS8(RD,WR,WREN,WRERR,FREE,LWLO,CFGS,EEPGD) b;
+} sim_eecon1_t;
+typedef union {
+    uint8_t v;
+    struct { uint8_t CCP1M:4, DC1B:2, P1M:2; } b;
+} sim_ccp1con_t;
+
+// Register storage, in sim.c
+extern volatile sim_porta_t   sim_LATA;
+extern volatile sim_portc_t   sim_LATC;
+extern volatile sim_porte_t   sim_LATE;
+extern volatile sim_trisa_t   sim_TRISA;
+extern volatile sim_trisc_t   sim_TRISC;
+extern volatile sim_trise_t   sim_TRISE;
+extern volatile sim_intcon_t  sim_INTCON;
+extern volatile sim_pie1_t    sim_PIE1;
+extern volatile sim_pir1_t    sim_PIR1;
+extern volatile sim_pir2_t    sim_PIR2;
+extern volatile sim_txsta_t   sim_TXSTA;
+extern volatile sim_rcsta_t   sim_RCSTA;
+extern volatile sim_baudcon_t sim_BAUDCON;
+extern volatile sim_adcon0_t  sim_ADCON0;
+extern volatile sim_option_t  sim_OPTION_REG;
+extern volatile sim_t1con_t   sim_T1CON;
+extern volatile sim_eecon1_t  sim_EECON1;
+extern volatile sim_ccp1con_t sim_CCP1CON;
+extern volatile uint8_t sim_LATB, sim_LATD, sim_TRISB, sim_TRISD;
+extern volatile uint8_t sim_ANSELA, sim_ANSELB, sim_ANSELC, sim_ANSELD;
+extern volatile uint8_t sim_ANSELE, sim_SPBRGL, sim_SPBRGH, sim_TMR0;
+extern volatile uint8_t sim_TMR1H, sim_TMR1L, sim_CCPR1H, sim_CCPR1L;
+extern volatile uint8_t sim_EEADRL, sim_EEADRH, sim_EEDATL, sim_EECON2;
+
+#define SIM_REG(r, T)  (*(volatile T *) sim_io(&sim_##r))
+#define SIM_U8(r)      (*(volatile uint8_t *) sim_io(&sim_##r))
+
+#define PORTAbits      SIM_REG(LATA, sim_porta_t).port
+#define LATAbits       SIM_REG(LATA, sim_porta_t).lat
+#define LATA           SIM_REG(LATA, sim_porta_t).v
+#define PORTCbits      SIM_REG(LATC, sim_portc_t).port
+#define LATCbits       SIM_REG(LATC, sim_portc_t).lat
+#define LATC           SIM_REG(LATC, sim_portc_t).v
+#define PORTEbits      SIM_REG(LATE, sim_porte_t).port
+#define LATEbits       SIM_REG(LATE, sim_porte_t).lat
+#define LATE           SIM_REG(LATE, sim_porte_t).v
+#define TRISAbits      SIM_REG(TRISA, sim_trisa_t).b
+#define TRISA          SIM_REG(TRISA, sim_trisa_t).v
+#define TRISCbits      SIM_REG(TRISC, sim_trisc_t).b
+#define TRISC          SIM_REG(TRISC, sim_trisc_t).v
+#define TRISEbits      SIM_REG(TRISE, sim_trise_t).b
+#define TRISE          SIM_REG(TRISE, sim_trise_t).v
+#define INTCONbits     SIM_REG(INTCON, sim_intcon_t).b
+#define INTCON         SIM_REG(INTCON, sim_intcon_t).v
+#define PIE1bits       SIM_REG(PIE1, sim_pie1_t).b
+#define PIR1bits       SIM_REG(PIR1, sim_pir1_t).b
+#define PIR2bits       SIM_REG(PIR2, sim_pir2_t).b
+#define TXSTAbits      SIM_REG(TXSTA, sim_txsta_t).b
+#define RCSTAbits      SIM_REG(RCSTA, sim_rcsta_t).b
+#define BAUDCONbits    SIM_REG(BAUDCON, sim_baudcon_t).b
+#define ADCON0bits     SIM_REG(ADCON0, sim_adcon0_t).b
+#define OPTION_REGbits SIM_REG(OPTION_REG, sim_option_t).b
+#define T1CONbits      SIM_REG(T1CON, sim_t1con_t).b
+#define EECON1bits     SIM_REG(EECON1, sim_eecon1_t).b
+#define CCP1CON        SIM_REG(CCP1CON, sim_ccp1con_t).v
+#define CCP1CONbits    SIM_REG(CCP1CON, sim_ccp1con_t).b
+#define LATB           SIM_U8(LATB)
+#define LATD           SIM_U8(LATD)
+#define TRISB          SIM_U8(TRISB)
+#define TRISD          SIM_U8(TRISD)
+#define ANSELA         SIM_U8(ANSELA)
+#define ANSELB         SIM_U8(ANSELB)
+#define ANSELC         SIM_U8(ANSELC)
+#define ANSELD         SIM_U8(ANSELD)
+#define ANSELE         SIM_U8(ANSELE)
+#define SPBRG          SIM_U8(SPBRGL)
+#define SPBRGL         SIM_U8(SPBRGL)
+#define SPBRGH         SIM_U8(SPBRGH)
+#define TMR0           SIM_U8(TMR0)
+#define TMR1H          SIM_U8(TMR1H)
+#define TMR1L          SIM_U8(TMR1L)
+#define CCPR1H         SIM_U8(CCPR1H)
+#define CCPR1L         SIM_U8(CCPR1L)
+#define EEADRL         SIM_U8(EEADRL)
+#define EEADRH         SIM_U8(EEADRH)
+#define EEDATL         SIM_U8(EEDATL)
+#define EECON2         SIM_U8(EECON2)
+
+// Port D is only read, the EPROM drives it. RCREG is only read and TXREG
+// only written, so sim.c can tell when the firmware does it.
+#define PORTD          sim_portd()
+#define RCREG          sim_rcreg()
+#define TXREG          (*sim_txreg())
+
+#endif // SIM_XC_H